@@ -9,37 +9,521 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
 #include <vector>
 #include <thread>
 #include <chrono>
 #include <iomanip>
 #include <cstring>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include <random>
+#include <cstdio>
+#include <climits>
+#include <charconv>
+#include <type_traits>
+#include <string_view>
+#include <map>
+#include <csignal>
+
+#if __has_include(<nghttp2/nghttp2.h>)
+#ifdef _MSC_VER
+typedef SSIZE_T ssize_t;
+#endif
+#include <nghttp2/nghttp2.h>
+#define HAVE_NGHTTP2 1
+#endif
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define HAVE_ZSTD 1
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#include <psapi.h>
+#include <afunix.h>
+#include <ws2tcpip.h>
 #else
 #include <locale>
 #include <codecvt>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
 
 using namespace std;
 
 
-struct ResponseData {
-    string content;
-    string contentDisposition;
-    long responseCode = 0;
+struct JobProgress;
+struct DiskFile;
+struct HostSlot;
+
+//       URL.
+struct DownloadJob {
+    string directoryPath;
+
+    //  : ,   ;    progress .
+    int id = 0;
+    bool urgent = false;
+    shared_ptr<JobProgress> progress;
 };
 
-struct DownloadTask {
+//  ,    Range-
+//      .
+struct SegmentedDownload {
     string url;
+    shared_ptr<const DownloadJob> job;
+    curl_off_t expectedSize = -1;
     string directoryPath;
     int taskId = 0;
+
+    string fileName;
+    string tempPath;
+    string cachedPath;
+    string etag;
+    string lastModified;
+    curl_off_t size = 0;
+    curl_off_t segmentSize = 0;
+    int segments = 0;
+    shared_ptr<DiskFile> file;
+    atomic<int> remaining{ 0 };
+    atomic<bool> failed{ false };
+};
+
+struct DownloadTask {
+    string url;
+    shared_ptr<const DownloadJob> job;
+    int taskId = 0;
+    string host;
+    chrono::steady_clock::time_point started;
+
+    //     -     .
+    shared_ptr<SegmentedDownload> segmented;
+    int segment = -1;
+
+    //         .
+    string resumePath;
+    curl_off_t resumeFrom = 0;
+
+    //     .
+    int attempt = 0;
+
+    //   HEAD- (--probe), -1 - .
+    curl_off_t expectedSize = -1;
+
+    //   ,   -    .
+    HostSlot* hostSlot = nullptr;
+};
+
+//  XXH64 (https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md).
+struct Xxh64State {
+    static constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t Prime3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t acc[4] = { Prime1 + Prime2, Prime2, 0, 0 - Prime1 };
+    unsigned char buffer[32];
+    size_t buffered = 0;
+    uint64_t total = 0;
+
+    static uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t Read64(const unsigned char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+    static uint32_t Read32(const unsigned char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+    static uint64_t Round(uint64_t acc, uint64_t input) { return Rotl(acc + input * Prime2, 31) * Prime1; }
+    static uint64_t Merge(uint64_t acc, uint64_t value) { return (acc ^ Round(0, value)) * Prime1 + Prime4; }
+
+    void Stripe(const unsigned char* p) {
+        for (int i = 0; i < 4; ++i) {
+            acc[i] = Round(acc[i], Read64(p + 8 * i));
+        }
+    }
+
+    void Update(const void* data, size_t size) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        total += size;
+        if (buffered > 0) {
+            size_t take = min(size, 32 - buffered);
+            memcpy(buffer + buffered, p, take);
+            buffered += take;
+            p += take;
+            size -= take;
+            if (buffered < 32) {
+                return;
+            }
+            Stripe(buffer);
+            buffered = 0;
+        }
+        for (; size >= 32; p += 32, size -= 32) {
+            Stripe(p);
+        }
+        memcpy(buffer, p, size);
+        buffered = size;
+    }
+
+    uint64_t Digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = Rotl(acc[0], 1) + Rotl(acc[1], 7) + Rotl(acc[2], 12) + Rotl(acc[3], 18);
+            for (uint64_t lane : acc) {
+                h = Merge(h, lane);
+            }
+        }
+        else {
+            h = Prime5;
+        }
+        h += total;
+
+        const unsigned char* p = buffer;
+        size_t left = buffered;
+        for (; left >= 8; p += 8, left -= 8) {
+            h = Rotl(h ^ Round(0, Read64(p)), 27) * Prime1 + Prime4;
+        }
+        if (left >= 4) {
+            h = Rotl(h ^ (Read32(p) * Prime1), 23) * Prime2 + Prime3;
+            p += 4;
+            left -= 4;
+        }
+        for (; left > 0; ++p, --left) {
+            h = Rotl(h ^ (*p * Prime5), 11) * Prime1;
+        }
+        h ^= h >> 33;
+        h *= Prime2;
+        h ^= h >> 29;
+        h *= Prime3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+//  SHA-256 (FIPS 180-4)   --dedup-sha256.
+struct Sha256State {
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned char buffer[64];
+    size_t buffered = 0;
+    uint64_t total = 0;
+
+    static uint32_t Rotr(uint32_t x, int r) { return (x >> r) | (x << (32 - r)); }
+
+    void Block(const unsigned char* p) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = uint32_t(p[4 * i]) << 24 | uint32_t(p[4 * i + 1]) << 16 | uint32_t(p[4 * i + 2]) << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = hh + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    void Update(const void* data, size_t size) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        total += size;
+        while (size > 0) {
+            size_t take = min(size, 64 - buffered);
+            if (buffered == 0 && size >= 64) {
+                Block(p);
+                take = 64;
+            }
+            else {
+                memcpy(buffer + buffered, p, take);
+                buffered += take;
+                if (buffered == 64) {
+                    Block(buffer);
+                    buffered = 0;
+                }
+            }
+            p += take;
+            size -= take;
+        }
+    }
+
+    string HexDigest() const {
+        Sha256State state = *this;
+        uint64_t bits = total * 8;
+        unsigned char pad[72] = { 0x80 };
+        size_t padSize = (buffered < 56 ? 56 : 120) - buffered;
+        for (int i = 0; i < 8; ++i) {
+            pad[padSize + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        state.Update(pad, padSize + 8);
+
+        static const char digits[] = "0123456789abcdef";
+        string hex;
+        for (uint32_t word : state.h) {
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                hex += digits[(word >> shift) & 0xf];
+            }
+        }
+        return hex;
+    }
+};
+
+//  ,        ( --dedup).
+struct ContentHasher {
+    bool active = false;
+    bool sha256 = false;
+    Xxh64State xxh;
+    Sha256State sha;
+
+    void Update(const void* data, size_t size) {
+        xxh.Update(data, size);
+        if (sha256) {
+            sha.Update(data, size);
+        }
+    }
+};
+
+struct SlistDeleter {
+    void operator()(curl_slist* list) const { curl_slist_free_all(list); }
+};
+
+#ifdef HAVE_ZSTD
+struct ZstdDeleter {
+    void operator()(ZSTD_CCtx* context) const { ZSTD_freeCCtx(context); }
+};
+#endif
+
+//     ChunkPool;     .
+struct ChunkDeleter {
+    void operator()(char* chunk) const;
+};
+using PooledChunk = unique_ptr<char[], ChunkDeleter>;
+
+//          ,
+//        .
+struct ResponseData {
+    string contentDisposition;
+    long responseCode = 0;
+    curl_off_t contentLength = -1;
+    bool acceptRanges = false;
+    string etag;
+    string lastModified;
+    string retryAfter;
+    string contentType;
+    string contentEncoding;
+
+    const DownloadTask* task = nullptr;
+
+    //     :  304    ,
+    //  200   .
+    string cachedPath;
+    unique_ptr<curl_slist, SlistDeleter> requestHeaders;
+    //     DNS (CURLOPT_RESOLVE).
+    unique_ptr<curl_slist, SlistDeleter> resolveList;
+
+    //    , ,   ,   
+    //       .
+    shared_ptr<DiskFile> sink;
+    PooledChunk chunk;
+    vector<PooledChunk> spareChunks;
+    size_t chunkUsed = 0;
+    curl_off_t sinkOffset = 0;
+    string fileName;
+    string tempPath;
+    curl_off_t bytesWritten = 0;
+    curl_off_t journalMark = 0;
+    curl_off_t resumedFrom = 0;
+    //       progressBytes.
+    curl_off_t progressCounted = 0;
+    //          .
+    chrono::steady_clock::duration diskWriteTime{};
+    ContentHasher hasher;
+
+    //   (--pack)    ,  :  
+    //    ;       .
+    bool packed = false;
+    vector<pair<PooledChunk, size_t>> packChunks;
+
+    //    (--store-zstd): storedBytes -    .
+    bool compressed = false;
+    curl_off_t storedBytes = 0;
+#ifdef HAVE_ZSTD
+    unique_ptr<ZSTD_CCtx, ZstdDeleter> zstd;
+#endif
+
+    //   ,      .
+    bool handedOff = false;
+
+    //    h2c   (--http2=prior-knowledge).
+    bool priorKnowledge = false;
+
+    //    ,       ( multi).
+    CURL* curl = nullptr;
+    bool paused = false;
+};
+
+const size_t SinkBufferSize = 64 * 1024;
+const curl_off_t JournalProgressStep = 8 * 1024 * 1024;
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error };
+
+//  ,    ,    .
+enum class RetryClass : uint8_t { Network, Timeout, Throttled, Server };
+
+struct RetryPolicy {
+    int attempts;
+    int baseMs;
+};
+
+//   . "threads" -    (curl_easy_perform),
+// "multi" -    curl_multi_socket_action.
+struct Options {
+    string engine = "threads";
+    int maxInFlight = 1000;
+
+    //           ;
+    // 0 -  .
+    curl_off_t segmentThreshold = 32 * 1024 * 1024;
+    int maxSegments = 8;
+
+    bool journal = true;
+    int journalSyncMs = 1000;
+
+    //    ETag / Last-Modified  "<dir>.manifest".
+    bool manifest = true;
+
+    //      (0 -  )    .
+    int perHostLimit = 8;
+    unordered_map<string, int> hostLimits;
+
+    bool benchDispatch = false;
+    bool benchLog = false;
+
+    // --bench:  ,  ,   ,
+    //      JSON lines.
+    bool bench = false;
+    string benchMix;
+    vector<int> benchThreads{ 1, 4, 16 };
+    int benchLatencyMs = 0;
+    curl_off_t benchBandwidth = 0;
+    int benchErrorPercent = 0;
+    string benchOut;
+
+    LogLevel logLevel = LogLevel::Info;
+    string logJson;
+
+    //    (Prometheus text,  JSON  *.json)   .
+    string metricsPath;
+    int metricsIntervalMs = 5000;
+
+    //     (AIMD)    , /.
+    bool adaptive = false;
+    curl_off_t maxBandwidth = 0;
+
+    //    RetryClass:    ; 
+    //    ,    retryMaxMs.
+    RetryPolicy retry[4] = { { 3, 500 }, { 2, 1000 }, { 5, 1000 }, { 3, 500 } };
+    int retryMaxMs = 60000;
+
+    //    (Accept-Encoding)   zstd     (0 -  ).
+    bool acceptEncoding = true;
+    int storeZstdLevel = 0;
+
+    // HTTP/2: "" -   libcurl, "on" - h2  ALPN, "prior-knowledge" - h2c;
+    //      multi.
+    string http2;
+    int maxStreams = 100;
+
+    //  :      .
+    string daemonSocket;
+    int daemonThreads = 8;
+
+    // HEAD-   ( )     .
+    bool probe = false;
+    int probeConcurrency = 64;
+
+    //     ( , 0 - ), 
+    //     ,    hosts  .
+    int dnsParallel = 32;
+    int dnsTtl = 300;
+    int dnsNegativeTtl = 60;
+    string hostsPath;
+
+    //          , .
+    curl_off_t memoryBudget = 256 * 1024 * 1024;
+
+    //  : "uring" ( Linux,  )  "threads",  .
+    string writer = "uring";
+    int writerThreads = 2;
+
+    //      ,    URL.
+    int queueBound = 10000;
+
+    //     URL    "<dir>.files";
+    // ,    --lookup  URL.
+    bool fileIndex = false;
+    int fanoutDepth = 0;
+    string lookupDirectory;
+
+    //    (0 -   ); , 
+    //   --extract  ,    .
+    curl_off_t packSegmentSize = 0;
+    string extractDirectory;
+    string extractTarget = ".";
+
+    //      ( ),   "<dir>.contents".
+    bool dedup = false;
+    bool dedupSha256 = false;
+};
+
+//      multi,   CURLOPT_PRIVATE.
+struct Transfer {
+    DownloadTask task;
+    ResponseData response;
 };
 
 
-queue<DownloadTask> taskQueue;
 mutex qMutex;
 condition_variable condition;
 atomic<bool> stopThreads{ false };
@@ -47,34 +531,400 @@ atomic<int> activeThreads{ 0 };
 atomic<int> completedTasks{ 0 };
 atomic<int> failedTasks{ 0 };
 atomic<int> totalTasks{ 0 };
+atomic<int> reusedConnections{ 0 };
+atomic<int> connectedTransfers{ 0 };
+Options options;
+
+//      DNS, TLS-  .
+CURLSH* curlShare = nullptr;
+mutex shareMutexes[CURL_LOCK_DATA_LAST];
 
 
- string GetCurrentTime() {
-    auto now = chrono::system_clock::now();
-    auto time_t = chrono::system_clock::to_time_t(now);
-    auto ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()) % 1000;
+//   .       
+//   ;     LogFlushMs    
+// ,   ,   (  
+//     )    . Warn  Error 
+//  stderr,   stdout;  --log-json     
+//   JSON lines.     ,  
+// .
 
-    stringstream ss;
-    ss << put_time(localtime(&time_t), "%H:%M:%S");
-    ss << "." << setfill('0') << setw(3) << ms.count();
-    return ss.str();
+const size_t LogTextSize = 480;
+const size_t LogRingCapacity = 512;
+const int LogFlushMs = 20;
+
+struct LogRecord {
+    int64_t time = 0;
+    int taskId = 0;
+    LogLevel level = LogLevel::Info;
+    uint16_t length = 0;
+    char text[LogTextSize];
+};
+
+struct LogRing {
+    LogRecord records[LogRingCapacity];
+    atomic<size_t> head{ 0 };
+    atomic<size_t> tail{ 0 };
+    atomic<bool> retired{ false };
+};
+
+struct Logger {
+    LogLevel level = LogLevel::Info;
+    FILE* out = stdout;
+    FILE* err = stderr;
+    FILE* json = nullptr;
+
+    mutex ringsMutex;
+    vector<LogRing*> rings;
+    mutex drainMutex;
+
+    mutex wakeMutex;
+    condition_variable wakeCondition;
+    thread flusher;
+    atomic<bool> running{ false };
+    bool stopping = false;
+
+    ~Logger();
+};
+
+Logger logger;
+
+//       , 
+//     .
+struct LogRingOwner {
+    LogRing* ring = nullptr;
+    ~LogRingOwner() {
+        if (ring) ring->retired = true;
+    }
+};
+
+thread_local LogRingOwner logRingOwner;
+
+LogRing& ThreadLogRing() {
+    if (!logRingOwner.ring) {
+        logRingOwner.ring = new LogRing();
+        lock_guard<mutex> lock(logger.ringsMutex);
+        logger.rings.push_back(logRingOwner.ring);
+    }
+    return *logRingOwner.ring;
 }
 
-size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userdata) {
-    if (!userdata || !contents || size == 0 || nmemb == 0) {
-        return 0;
+int64_t LogClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// "--"  "::"  ,  .
+struct LogTimeCache {
+    int64_t second = -1;
+    char date[11] = "";
+    char clock[9] = "";
+
+    void Update(int64_t time) {
+        int64_t current = time / 1000000000;
+        if (current == second) {
+            return;
+        }
+        second = current;
+        time_t value = static_cast<time_t>(current);
+        tm local{};
+#ifdef _WIN32
+        localtime_s(&local, &value);
+#else
+        localtime_r(&value, &local);
+#endif
+        strftime(date, sizeof(date), "%Y-%m-%d", &local);
+        strftime(clock, sizeof(clock), "%H:%M:%S", &local);
     }
+};
 
-    string* data = static_cast<string*>(userdata);
-    size_t total_size = size * nmemb;
+const char* LogLevelName(LogLevel level) {
+    switch (level) {
+    case LogLevel::Debug: return "debug";
+    case LogLevel::Info: return "info";
+    case LogLevel::Warn: return "warn";
+    default: return "error";
+    }
+}
 
-    try {
-        data->append(static_cast<char*>(contents), total_size);
-        return total_size;
+//    cp1251,  JSON    UTF-8: 0xC0-0xFF - 
+// U+0410-U+044F,  0x80-0xBF  .
+const uint16_t Cp1251High[64] = {
+    0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,
+    0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0xFFFD, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,
+    0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7,
+    0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,
+    0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7,
+    0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457,
+};
+
+void AppendCp1251AsUtf8(string& out, unsigned char c) {
+    unsigned code = c >= 0xC0 ? 0x0410 + (c - 0xC0) : Cp1251High[c - 0x80];
+    if (code < 0x800) {
+        out += static_cast<char>(0xC0 | (code >> 6));
     }
-    catch (...) {
-        return 0;
+    else {
+        out += static_cast<char>(0xE0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+    }
+    out += static_cast<char>(0x80 | (code & 0x3F));
+}
+
+void AppendJsonString(string& out, const char* text, size_t length) {
+    out += '"';
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else if (c >= 0x80) {
+            AppendCp1251AsUtf8(out, c);
+        }
+        else {
+            out += static_cast<char>(c);
+        }
+    }
+    out += '"';
+}
+
+void FormatLogRecord(const LogRecord& record, LogTimeCache& timeCache, string& text, string& json) {
+    timeCache.Update(record.time);
+    char millis[16];
+    snprintf(millis, sizeof(millis), ".%03d", static_cast<int>(record.time / 1000000 % 1000));
+
+    text += '[';
+    text += timeCache.clock;
+    text += millis;
+    text += "] ";
+    if (record.taskId > 0) {
+        text += "[ " + to_string(record.taskId) + "] ";
+    }
+    text.append(record.text, record.length);
+    text += '\n';
+
+    if (logger.json) {
+        json += "{\"time\":\"";
+        json += timeCache.date;
+        json += 'T';
+        json += timeCache.clock;
+        json += millis;
+        json += "\",\"level\":\"";
+        json += LogLevelName(record.level);
+        json += '"';
+        if (record.taskId > 0) {
+            json += ",\"task\":" + to_string(record.taskId);
+        }
+        json += ",\"msg\":";
+        AppendJsonString(json, record.text, record.length);
+        json += "}\n";
+    }
+}
+
+//        .
+void DrainLogRings(LogTimeCache& timeCache) {
+    lock_guard<mutex> drainLock(logger.drainMutex);
+    struct Pending {
+        LogRing* ring;
+        size_t head;
+    };
+    vector<Pending> pending;
+    vector<const LogRecord*> records;
+    {
+        lock_guard<mutex> lock(logger.ringsMutex);
+        for (LogRing* ring : logger.rings) {
+            size_t head = ring->head.load(memory_order_acquire);
+            for (size_t i = ring->tail.load(memory_order_relaxed); i != head; ++i) {
+                records.push_back(&ring->records[i % LogRingCapacity]);
+            }
+            pending.push_back({ ring, head });
+        }
+    }
+
+    stable_sort(records.begin(), records.end(), [](const LogRecord* a, const LogRecord* b) { return a->time < b->time; });
+    string out;
+    string err;
+    string json;
+    for (const LogRecord* record : records) {
+        FormatLogRecord(*record, timeCache, record->level >= LogLevel::Warn ? err : out, json);
+    }
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), logger.out);
+        fflush(logger.out);
+    }
+    if (!err.empty()) {
+        fwrite(err.data(), 1, err.size(), logger.err);
+        fflush(logger.err);
+    }
+    if (!json.empty()) {
+        fwrite(json.data(), 1, json.size(), logger.json);
+    }
+
+    lock_guard<mutex> lock(logger.ringsMutex);
+    for (const Pending& item : pending) {
+        item.ring->tail.store(item.head, memory_order_release);
+    }
+    //        .
+    logger.rings.erase(remove_if(logger.rings.begin(), logger.rings.end(), [](LogRing* ring) {
+        if (ring->retired && ring->tail.load() == ring->head.load()) {
+            delete ring;
+            return true;
+        }
+        return false;
+    }), logger.rings.end());
+}
+
+void LogFlushLoop() {
+    LogTimeCache timeCache;
+    unique_lock<mutex> lock(logger.wakeMutex);
+    while (true) {
+        logger.wakeCondition.wait_for(lock, chrono::milliseconds(LogFlushMs));
+        bool stopping = logger.stopping;
+        lock.unlock();
+        DrainLogRings(timeCache);
+        lock.lock();
+        if (stopping) {
+            break;
+        }
+    }
+}
+
+bool StartLogger(LogLevel level, const string& jsonPath) {
+    logger.level = level;
+    if (!jsonPath.empty()) {
+        logger.json = fopen(jsonPath.c_str(), "ab");
+        if (!logger.json) {
+            return false;
+        }
+    }
+    logger.stopping = false;
+    logger.running = true;
+    logger.flusher = thread(LogFlushLoop);
+    return true;
+}
+
+//       ;   
+//  .
+void StopLogger() {
+    if (!logger.running) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(logger.wakeMutex);
+        logger.stopping = true;
+    }
+    logger.wakeCondition.notify_one();
+    logger.flusher.join();
+    logger.running = false;
+    if (logger.json) {
+        fclose(logger.json);
+        logger.json = nullptr;
+    }
+}
+
+Logger::~Logger() {
+    StopLogger();
+}
+
+//   : Log(LogLevel::Info, taskId) << "" << ;
+//           .
+class Log {
+public:
+    Log(LogLevel level, int taskId = 0) {
+        if (level < logger.level) {
+            return;
+        }
+        ring = &ThreadLogRing();
+        head = ring->head.load(memory_order_relaxed);
+        while (head - ring->tail.load(memory_order_acquire) >= LogRingCapacity) {
+            if (!logger.running) {
+                LogTimeCache timeCache;
+                DrainLogRings(timeCache);
+                continue;
+            }
+            logger.wakeCondition.notify_one();
+            this_thread::yield();
+        }
+        record = &ring->records[head % LogRingCapacity];
+        record->time = LogClock();
+        record->taskId = taskId;
+        record->level = level;
+        record->length = 0;
+    }
+
+    ~Log() {
+        if (!record) {
+            return;
+        }
+        ring->head.store(head + 1, memory_order_release);
+        if (!logger.running) {
+            LogTimeCache timeCache;
+            DrainLogRings(timeCache);
+        }
+    }
+
+    Log(const Log&) = delete;
+    Log& operator=(const Log&) = delete;
+
+    Log& operator<<(const char* text) {
+        return Append(text, strlen(text));
+    }
+
+    Log& operator<<(const string& text) {
+        return Append(text.data(), text.size());
+    }
+
+    Log& operator<<(char c) {
+        return Append(&c, 1);
+    }
+
+    template <typename T, typename = enable_if_t<is_integral_v<T>>>
+    Log& operator<<(T value) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        return Append(digits, result.ptr - digits);
+    }
+
+private:
+    //       .
+    Log& Append(const char* text, size_t length) {
+        if (record) {
+            length = min(length, LogTextSize - record->length);
+            memcpy(record->text + record->length, text, length);
+            record->length = static_cast<uint16_t>(record->length + length);
+        }
+        return *this;
+    }
+
+    LogRing* ring = nullptr;
+    LogRecord* record = nullptr;
+    size_t head = 0;
+};
+
+//      ( HTTP/2     ).
+bool HeaderIs(string_view header, const char* name) {
+    size_t len = strlen(name);
+    if (header.size() <= len || header[len] != ':') {
+        return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        if (tolower(static_cast<unsigned char>(header[i])) != name[i]) {
+            return false;
+        }
     }
+    return true;
+}
+
+//    ":",   CRLF.
+string_view HeaderValue(string_view header, size_t nameLength) {
+    size_t first = header.find_first_not_of(" \t", nameLength + 1);
+    size_t last = header.find_last_not_of(" \t\r\n");
+    return first == string_view::npos || last < first ? string_view() : header.substr(first, last - first + 1);
 }
 
 size_t HeaderCallback(void* contents, size_t size, size_t nmemb, void* userdata) {
@@ -85,11 +935,50 @@ size_t HeaderCallback(void* contents, size_t size, size_t nmemb, void* userdata)
     ResponseData* response = static_cast<ResponseData*>(userdata);
     size_t total_size = size * nmemb;
 
+    //    ;   ,   .
     try {
-        string header(static_cast<const char*>(contents), total_size);
+        string_view header(static_cast<const char*>(contents), total_size);
 
-        if (header.find("Content-Disposition:") != string::npos) {
-            response->contentDisposition = header;
+        //    ( ..  ) -     .
+        if (header.substr(0, 5) == "HTTP/") {
+            response->contentDisposition.clear();
+            response->etag.clear();
+            response->lastModified.clear();
+            response->retryAfter.clear();
+            response->contentType.clear();
+            response->contentEncoding.clear();
+            response->contentLength = -1;
+            response->acceptRanges = false;
+            size_t space = header.find(' ');
+            response->responseCode = 0;
+            if (space != string_view::npos) {
+                from_chars(header.data() + space + 1, header.data() + header.size(), response->responseCode);
+            }
+        }
+        else if (HeaderIs(header, "content-disposition")) {
+            response->contentDisposition.assign(header);
+        }
+        else if (HeaderIs(header, "content-length")) {
+            string_view value = HeaderValue(header, 14);
+            from_chars(value.data(), value.data() + value.size(), response->contentLength);
+        }
+        else if (HeaderIs(header, "accept-ranges")) {
+            response->acceptRanges = HeaderValue(header, 13).find("bytes") != string_view::npos;
+        }
+        else if (HeaderIs(header, "etag")) {
+            response->etag.assign(HeaderValue(header, 4));
+        }
+        else if (HeaderIs(header, "last-modified")) {
+            response->lastModified.assign(HeaderValue(header, 13));
+        }
+        else if (HeaderIs(header, "retry-after")) {
+            response->retryAfter.assign(HeaderValue(header, 11));
+        }
+        else if (HeaderIs(header, "content-type")) {
+            response->contentType.assign(HeaderValue(header, 12));
+        }
+        else if (HeaderIs(header, "content-encoding")) {
+            response->contentEncoding.assign(HeaderValue(header, 16));
         }
         return total_size;
     }
@@ -201,221 +1090,6534 @@ string ReplaceUnvalidName(const string& filename) {
     return replace;
 }
 
-string UniqueFileName(const filesystem::path& directory, const string& filename) {
-    filesystem::path basePath = directory / filename;
+//     .    , 
+//      :    
+//    " (N)",   index.html 
+//    .
+struct DirectoryNames {
+    unordered_set<string> taken;
+    unordered_map<string, int> nextCounter;
+};
 
-    if (!filesystem::exists(basePath)) {
-        return basePath.string();
-    }
-    string stem = basePath.stem().string();
-    string extension = basePath.extension().string();
+mutex namesMutex;
+unordered_map<string, DirectoryNames> directoryNames;
 
-    for (int counter = 1; counter < 1000; ++counter) {
-        filesystem::path new_path;
-        if (extension.empty()) {
-            new_path = directory / (stem + " (" + to_string(counter) + ")");
+//  :  Windows     .
+string NameKey(const string& name) {
+#ifdef _WIN32
+    string key = name;
+    transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    return key;
+#else
+    return name;
+#endif
+}
+
+DirectoryNames& LoadDirectoryNames(const filesystem::path& directory) {
+    auto found = directoryNames.find(directory.string());
+    if (found != directoryNames.end()) {
+        return found->second;
+    }
+    DirectoryNames& names = directoryNames[directory.string()];
+    error_code ec;
+    for (filesystem::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        names.taken.insert(NameKey(it->path().filename().string()));
+    }
+    return names;
+}
+
+//          .
+string ReserveFileName(const filesystem::path& directory, const string& filename) {
+    lock_guard<mutex> lock(namesMutex);
+    DirectoryNames& names = LoadDirectoryNames(directory);
+
+    if (names.taken.insert(NameKey(filename)).second) {
+        return (directory / filename).string();
+    }
+
+    filesystem::path basePath(filename);
+    string stem = basePath.stem().string();
+    string extension = basePath.extension().string();
+    int& counter = names.nextCounter[NameKey(filename)];
+    counter = max(counter, 1);
+    while (true) {
+        string candidate = stem + " (" + to_string(counter++) + ")" + extension;
+        if (names.taken.insert(NameKey(candidate)).second) {
+            return (directory / candidate).string();
+        }
+    }
+}
+
+void ReleaseFileName(const filesystem::path& directory, const string& fullPath) {
+    lock_guard<mutex> lock(namesMutex);
+    auto found = directoryNames.find(directory.string());
+    if (found != directoryNames.end()) {
+        found->second.taken.erase(NameKey(filesystem::path(fullPath).filename().string()));
+    }
+}
+
+// ,      :
+//    ec == errc::file_exists.
+void RenameNoReplace(const string& from, const string& to, error_code& ec) {
+    ec.clear();
+#ifdef _WIN32
+    if (!MoveFileExW(filesystem::path(from).c_str(), filesystem::path(to).c_str(), 0)) {
+        DWORD error = GetLastError();
+        ec = error == ERROR_ALREADY_EXISTS || error == ERROR_FILE_EXISTS
+            ? make_error_code(errc::file_exists) : error_code(static_cast<int>(error), system_category());
+    }
+#else
+#if defined(__linux__) && defined(SYS_renameat2)
+    if (syscall(SYS_renameat2, AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_NOREPLACE) == 0) {
+        return;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+        ec = error_code(errno, generic_category());
+        return;
+    }
+#endif
+    //    renameat2: link()     .
+    if (link(from.c_str(), to.c_str()) != 0) {
+        ec = error_code(errno, generic_category());
+        return;
+    }
+    unlink(from.c_str());
+#endif
+}
+
+void ShareLock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr) {
+    shareMutexes[data].lock();
+}
+
+void ShareUnlock(CURL* handle, curl_lock_data data, void* userptr) {
+    shareMutexes[data].unlock();
+}
+
+bool InitCurlShare() {
+    curlShare = curl_share_init();
+    if (!curlShare) {
+        return false;
+    }
+    curl_share_setopt(curlShare, CURLSHOPT_LOCKFUNC, ShareLock);
+    curl_share_setopt(curlShare, CURLSHOPT_UNLOCKFUNC, ShareUnlock);
+    curl_share_setopt(curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    //  HTTP/2  ,      
+    //     ;  --http2     .
+    if (options.http2.empty()) {
+        curl_share_setopt(curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+    return true;
+}
+
+//  .  :
+//  -        -,   ,
+//          . 
+//     (--per-host, --host-limit)    HostSlot: 
+//            ,  
+//           ;
+//  -    ( -   ):   
+//    ,   limit    ,  
+//             ;   qMutex.
+struct HostQueue {
+    string host;
+    deque<DownloadTask> tasks;
+    //        .
+    deque<DownloadTask> priorityTasks;
+    int inFlight = 0;
+    int limit = 0;
+    bool ready = false;
+};
+
+unordered_map<string, HostQueue> hostQueues;
+deque<HostQueue*> readyHosts;
+size_t queuedTasks = 0;
+
+//            .
+struct HostStats {
+    int transfers = 0;
+    curl_off_t bytes = 0;
+    chrono::steady_clock::time_point firstStart = chrono::steady_clock::time_point::max();
+    chrono::steady_clock::time_point lastFinish;
+};
+
+//  - (Le  ., "Correct and Efficient Work-Stealing for Weak Memory
+// Models"):     ,    .
+//        .
+struct TaskDeque {
+    struct Ring {
+        int64_t capacity;
+        unique_ptr<atomic<DownloadTask*>[]> slots;
+
+        explicit Ring(int64_t size) : capacity(size), slots(new atomic<DownloadTask*>[size]) {}
+        DownloadTask* Get(int64_t i) const { return slots[i & (capacity - 1)].load(memory_order_relaxed); }
+        void Put(int64_t i, DownloadTask* task) { slots[i & (capacity - 1)].store(task, memory_order_relaxed); }
+    };
+
+    atomic<int64_t> top{ 0 };
+    atomic<int64_t> bottom{ 0 };
+    atomic<Ring*> ring;
+    vector<unique_ptr<Ring>> rings;
+
+    TaskDeque() {
+        rings.emplace_back(new Ring(1024));
+        ring.store(rings.back().get(), memory_order_relaxed);
+    }
+
+    ~TaskDeque() {
+        while (DownloadTask* task = Pop()) {
+            delete task;
+        }
+    }
+
+    void Push(DownloadTask* task) {
+        int64_t b = bottom.load(memory_order_relaxed);
+        int64_t t = top.load(memory_order_acquire);
+        Ring* r = ring.load(memory_order_relaxed);
+        if (b - t > r->capacity - 1) {
+            Ring* grown = new Ring(r->capacity * 2);
+            for (int64_t i = t; i < b; ++i) {
+                grown->Put(i, r->Get(i));
+            }
+            rings.emplace_back(grown);
+            ring.store(grown, memory_order_release);
+            r = grown;
+        }
+        r->Put(b, task);
+        atomic_thread_fence(memory_order_release);
+        bottom.store(b + 1, memory_order_relaxed);
+    }
+
+    DownloadTask* Pop() {
+        int64_t b = bottom.load(memory_order_relaxed) - 1;
+        Ring* r = ring.load(memory_order_relaxed);
+        bottom.store(b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = top.load(memory_order_relaxed);
+
+        DownloadTask* task = nullptr;
+        if (t <= b) {
+            task = r->Get(b);
+            if (t == b) {
+                if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+                    task = nullptr;
+                }
+                bottom.store(b + 1, memory_order_relaxed);
+            }
+        }
+        else {
+            bottom.store(b + 1, memory_order_relaxed);
+        }
+        return task;
+    }
+
+    DownloadTask* Steal() {
+        int64_t t = top.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = bottom.load(memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        DownloadTask* task = ring.load(memory_order_acquire)->Get(t);
+        if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            return nullptr;
+        }
+        return task;
+    }
+};
+
+struct WorkerQueue {
+    TaskDeque tasks;
+    mutex inboxMutex;
+    vector<DownloadTask*> inbox;
+    atomic<bool> hasInbox{ false };
+    unordered_map<string, HostStats> hostStats;
+};
+
+vector<unique_ptr<WorkerQueue>> workerQueues;
+thread_local int workerIndex = -1;
+atomic<long long> pendingTasks{ 0 };
+atomic<int> sleepingWorkers{ 0 };
+atomic<unsigned> nextInbox{ 0 };
+mutex idleMutex;
+condition_variable idleCondition;
+// ,     ,   ;  
+//  ,    .
+atomic<uint64_t> stealEpoch{ 0 };
+//     ,    ,   .
+const int StealSpinLimit = 64;
+
+struct HostSlot {
+    atomic<int> inFlight{ 0 };
+    int limit = 0;
+    //    ,     .
+    atomic<int> waiting{ 0 };
+    mutex parkedMutex;
+    deque<DownloadTask*> parked;
+
+    ~HostSlot() {
+        for (DownloadTask* task : parked) {
+            delete task;
+        }
+    }
+};
+
+shared_mutex hostSlotsMutex;
+unordered_map<string, unique_ptr<HostSlot>> hostSlots;
+atomic<long long> parkedTasks{ 0 };
+
+//       .
+bool hostScheduler = false;
+
+//   : main      .
+struct CompletionLatch {
+    atomic<long long> pending{ 0 };
+    mutex latchMutex;
+    condition_variable latchCondition;
+
+    void Add(long long count) {
+        pending += count;
+    }
+
+    void CountDown() {
+        if (--pending <= 0) {
+            lock_guard<mutex> lock(latchMutex);
+            latchCondition.notify_all();
+        }
+    }
+
+    bool WaitFor(chrono::milliseconds timeout) {
+        unique_lock<mutex> lock(latchMutex);
+        return latchCondition.wait_for(lock, timeout, [this] { return pending <= 0; });
+    }
+};
+
+CompletionLatch tasksLatch;
+
+//    ; latch ,     .
+struct JobProgress {
+    CompletionLatch latch;
+    atomic<int> total{ 0 };
+    atomic<int> completed{ 0 };
+    atomic<int> failed{ 0 };
+};
+
+bool UseWorkStealing() {
+    return !hostScheduler;
+}
+
+//    :     .
+void InitDispatcher(int workers) {
+    workerQueues.clear();
+    for (int i = 0; i < workers; ++i) {
+        workerQueues.emplace_back(new WorkerQueue());
+    }
+    hostQueues.clear();
+    readyHosts.clear();
+    queuedTasks = 0;
+    pendingTasks = 0;
+    hostSlots.clear();
+    parkedTasks = 0;
+}
+
+string ExtractHost(const string& url) {
+    size_t start = url.find("://");
+    start = start == string::npos ? 0 : start + 3;
+    size_t end = url.find_first_of("/?#", start);
+    string host = url.substr(start, end == string::npos ? string::npos : end - start);
+
+    size_t at = host.rfind('@');
+    if (at != string::npos) {
+        host = host.substr(at + 1);
+    }
+    for (char& c : host) {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return host;
+}
+
+int HostLimit(const string& host) {
+    auto it = options.hostLimits.find(host);
+    return it != options.hostLimits.end() ? it->second : options.perHostLimit;
+}
+
+//  ;          .
+HostSlot* HostSlotFor(const string& host) {
+    {
+        shared_lock<shared_mutex> lock(hostSlotsMutex);
+        auto it = hostSlots.find(host);
+        if (it != hostSlots.end()) {
+            return it->second.get();
+        }
+    }
+    unique_lock<shared_mutex> lock(hostSlotsMutex);
+    unique_ptr<HostSlot>& slot = hostSlots[host];
+    if (!slot) {
+        slot.reset(new HostSlot());
+        slot->limit = HostLimit(host);
+    }
+    return slot.get();
+}
+
+void WakeWorkers(long long added) {
+    pendingTasks += added;
+    stealEpoch++;
+    if (sleepingWorkers > 0) {
+        lock_guard<mutex> lock(idleMutex);
+        if (added > 1) {
+            idleCondition.notify_all();
+        }
+        else {
+            idleCondition.notify_one();
+        }
+    }
+}
+
+//       index (   ).
+void AddToInbox(size_t index, vector<DownloadTask*>& batch) {
+    WorkerQueue& queue = *workerQueues[index];
+    lock_guard<mutex> lock(queue.inboxMutex);
+    queue.inbox.insert(queue.inbox.end(), batch.begin(), batch.end());
+    queue.hasInbox = true;
+}
+
+void AddHostTaskLocked(DownloadTask task, bool urgent) {
+    HostQueue& queue = hostQueues[task.host];
+    if (queue.host.empty()) {
+        queue.host = task.host;
+        queue.limit = HostLimit(task.host);
+    }
+    if (urgent) {
+        queue.priorityTasks.push_front(move(task));
+    }
+    else if (task.job && task.job->urgent) {
+        queue.priorityTasks.push_back(move(task));
+    }
+    else {
+        queue.tasks.push_back(move(task));
+    }
+    queuedTasks++;
+    if (!queue.ready) {
+        queue.ready = true;
+        readyHosts.push_back(&queue);
+    }
+}
+
+//    ,    -   .
+void PushStealTask(DownloadTask* item) {
+    if (workerIndex >= 0) {
+        workerQueues[workerIndex]->tasks.Push(item);
+    }
+    else {
+        vector<DownloadTask*> batch{ item };
+        AddToInbox(nextInbox++ % workerQueues.size(), batch);
+    }
+    WakeWorkers(1);
+}
+
+// urgent -     (   ).
+void AddQueue(DownloadTask task, bool urgent = false) {
+    if (task.host.empty()) {
+        task.host = ExtractHost(task.url);
+    }
+    if (UseWorkStealing()) {
+        if (!task.hostSlot) {
+            task.hostSlot = HostSlotFor(task.host);
+        }
+        PushStealTask(new DownloadTask(move(task)));
+        return;
+    }
+    {
+        lock_guard<mutex> lock(qMutex);
+        AddHostTaskLocked(move(task), urgent);
+    }
+    condition.notify_one();
+}
+
+//       ,     .
+void AddQueueBulk(vector<DownloadTask>& tasks) {
+    if (tasks.empty()) {
+        return;
+    }
+    HostSlot* lastSlot = nullptr;
+    const string* lastHost = nullptr;
+    for (DownloadTask& task : tasks) {
+        if (task.host.empty()) {
+            task.host = ExtractHost(task.url);
+        }
+        if (UseWorkStealing() && !task.hostSlot) {
+            if (!lastHost || *lastHost != task.host) {
+                lastSlot = HostSlotFor(task.host);
+                lastHost = &task.host;
+            }
+            task.hostSlot = lastSlot;
+        }
+    }
+    if (UseWorkStealing()) {
+        size_t workers = workerQueues.size();
+        size_t first = nextInbox.fetch_add(1);
+        vector<DownloadTask*> batch;
+        for (size_t w = 0; w < workers; ++w) {
+            batch.clear();
+            for (size_t i = w; i < tasks.size(); i += workers) {
+                batch.push_back(new DownloadTask(move(tasks[i])));
+            }
+            if (!batch.empty()) {
+                AddToInbox((first + w) % workers, batch);
+            }
+        }
+        WakeWorkers(static_cast<long long>(tasks.size()));
+    }
+    else {
+        {
+            lock_guard<mutex> lock(qMutex);
+            for (DownloadTask& task : tasks) {
+                AddHostTaskLocked(move(task), false);
+            }
+        }
+        condition.notify_all();
+    }
+    tasks.clear();
+}
+
+//           .
+DownloadTask* TakeFromInbox(size_t index, bool own) {
+    WorkerQueue& queue = *workerQueues[index];
+    if (!queue.hasInbox) {
+        return nullptr;
+    }
+    vector<DownloadTask*> taken;
+    {
+        unique_lock<mutex> lock(queue.inboxMutex, defer_lock);
+        if (own) {
+            lock.lock();
+        }
+        else if (!lock.try_lock()) {
+            return nullptr;
+        }
+        if (queue.inbox.empty()) {
+            return nullptr;
+        }
+        size_t keep = own ? 0 : queue.inbox.size() / 2;
+        taken.assign(queue.inbox.begin() + keep, queue.inbox.end());
+        queue.inbox.resize(keep);
+        queue.hasInbox = !queue.inbox.empty();
+    }
+    //      ,   Pop   
+    //  ( --probe -    ).
+    DownloadTask* task = taken.front();
+    TaskDeque& mine = workerQueues[workerIndex]->tasks;
+    for (auto it = taken.rbegin(); it + 1 != taken.rend(); ++it) {
+        mine.Push(*it);
+    }
+    //     -  .
+    if (taken.size() > 1) {
+        stealEpoch++;
+        if (sleepingWorkers > 0) {
+            lock_guard<mutex> lock(idleMutex);
+            idleCondition.notify_all();
+        }
+    }
+    return task;
+}
+
+DownloadTask* FindStealTask() {
+    size_t workers = workerQueues.size();
+    size_t self = static_cast<size_t>(workerIndex);
+
+    if (DownloadTask* task = workerQueues[self]->tasks.Pop()) {
+        return task;
+    }
+    if (DownloadTask* task = TakeFromInbox(self, true)) {
+        return task;
+    }
+    for (size_t i = 1; i < workers; ++i) {
+        size_t victim = (self + i) % workers;
+        if (DownloadTask* task = workerQueues[victim]->tasks.Steal()) {
+            return task;
+        }
+        if (DownloadTask* task = TakeFromInbox(victim, false)) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+//       .   -   
+//  .    waiting   
+// inFlight, ReleaseHost  inFlight    waiting,  
+//            .
+bool AcquireHostSlot(DownloadTask* task) {
+    HostSlot* slot = task->hostSlot;
+    if (!slot || slot->limit <= 0) {
+        return true;
+    }
+    int current = slot->inFlight;
+    while (current < slot->limit) {
+        if (slot->inFlight.compare_exchange_weak(current, current + 1)) {
+            return true;
+        }
+    }
+    lock_guard<mutex> lock(slot->parkedMutex);
+    slot->waiting++;
+    current = slot->inFlight;
+    while (current < slot->limit) {
+        if (slot->inFlight.compare_exchange_weak(current, current + 1)) {
+            slot->waiting--;
+            return true;
+        }
+    }
+    slot->parked.push_back(task);
+    parkedTasks++;
+    return false;
+}
+
+bool PopStealTask(DownloadTask& task, bool block) {
+    int misses = 0;
+    while (true) {
+        uint64_t epoch = stealEpoch;
+        if (DownloadTask* found = FindStealTask()) {
+            pendingTasks--;
+            if (!AcquireHostSlot(found)) {
+                continue;
+            }
+            task = move(*found);
+            delete found;
+            return true;
+        }
+        if (pendingTasks > 0 && ++misses < StealSpinLimit) {
+            //  ,      -  .
+            this_thread::yield();
+            continue;
+        }
+        if (!block) {
+            return false;
+        }
+
+        misses = 0;
+        unique_lock<mutex> lock(idleMutex);
+        sleepingWorkers++;
+        idleCondition.wait(lock, [epoch] { return stealEpoch != epoch || stopThreads; });
+        sleepingWorkers--;
+        if (pendingTasks <= 0 && stopThreads) {
+            return false;
+        }
+    }
+}
+
+//   qMutex.      ,  .
+bool PopTaskLocked(DownloadTask& task) {
+    for (size_t checked = readyHosts.size(); checked > 0; --checked) {
+        HostQueue* queue = readyHosts.front();
+        readyHosts.pop_front();
+
+        if (queue->limit > 0 && queue->inFlight >= queue->limit) {
+            readyHosts.push_back(queue);
+            continue;
+        }
+
+        deque<DownloadTask>& tasks = queue->priorityTasks.empty() ? queue->tasks : queue->priorityTasks;
+        task = move(tasks.front());
+        tasks.pop_front();
+        queuedTasks--;
+        queue->inFlight++;
+        if (queue->tasks.empty() && queue->priorityTasks.empty()) {
+            queue->ready = false;
+        }
+        else {
+            readyHosts.push_back(queue);
+        }
+        return true;
+    }
+    return false;
+}
+
+size_t QueuedTaskCount() {
+    if (UseWorkStealing()) {
+        long long pending = pendingTasks + parkedTasks;
+        return pending > 0 ? static_cast<size_t>(pending) : 0;
+    }
+    lock_guard<mutex> lock(qMutex);
+    return queuedTasks;
+}
+
+//   ,      queueBound;  
+// ,  .
+mutex boundMutex;
+condition_variable boundCondition;
+atomic<int> boundWaiters{ 0 };
+
+void SignalQueueDrained() {
+    if (boundWaiters > 0 && QueuedTaskCount() < static_cast<size_t>(options.queueBound)) {
+        lock_guard<mutex> lock(boundMutex);
+        boundCondition.notify_all();
+    }
+}
+
+void WaitQueueBelowBound() {
+    unique_lock<mutex> lock(boundMutex);
+    boundWaiters++;
+    boundCondition.wait(lock, [] { return QueuedTaskCount() < static_cast<size_t>(options.queueBound); });
+    boundWaiters--;
+}
+
+bool TryPopTask(DownloadTask& task) {
+    if (UseWorkStealing()) {
+        if (!PopStealTask(task, false)) {
+            return false;
+        }
+    }
+    else {
+        lock_guard<mutex> lock(qMutex);
+        if (!PopTaskLocked(task)) {
+            return false;
+        }
+    }
+    SignalQueueDrained();
+    task.started = chrono::steady_clock::now();
+    return true;
+}
+
+//  ,     (    ).
+// false -       .
+bool PopTask(DownloadTask& task) {
+    if (UseWorkStealing()) {
+        if (!PopStealTask(task, true)) {
+            return false;
+        }
+    }
+    else {
+        unique_lock<mutex> lock(qMutex);
+        while (!PopTaskLocked(task)) {
+            if (stopThreads && queuedTasks == 0) {
+                return false;
+            }
+            condition.wait(lock);
+        }
+    }
+    SignalQueueDrained();
+    task.started = chrono::steady_clock::now();
+    return true;
+}
+
+//    .     
+//   ;    ,  --adaptive 
+//  AdaptiveControlLoop,  "limit N"   .
+struct TransferGate {
+    atomic<int> limit{ INT_MAX };
+    atomic<int> inFlight{ 0 };
+    atomic<int> peakInFlight{ 0 };
+    mutex gateMutex;
+    condition_variable gateCondition;
+};
+
+TransferGate transferGate;
+
+bool AcquireTransferSlot(bool block) {
+    int current = transferGate.inFlight.load();
+    while (true) {
+        while (current < transferGate.limit.load()) {
+            if (transferGate.inFlight.compare_exchange_weak(current, current + 1)) {
+                int peak = transferGate.peakInFlight.load();
+                while (current + 1 > peak && !transferGate.peakInFlight.compare_exchange_weak(peak, current + 1)) {
+                }
+                return true;
+            }
+        }
+        if (!block || stopThreads) {
+            return false;
+        }
+        unique_lock<mutex> lock(transferGate.gateMutex);
+        transferGate.gateCondition.wait_for(lock, chrono::milliseconds(100));
+        current = transferGate.inFlight.load();
+    }
+}
+
+void ReleaseTransferSlot() {
+    transferGate.inFlight--;
+    transferGate.gateCondition.notify_one();
+}
+
+void SetTransferLimit(int limit) {
+    transferGate.limit = limit;
+    transferGate.gateCondition.notify_all();
+}
+
+//      :    rate / 
+//   100 . ,    ,   
+//  (  multi -   ,      ).
+struct BandwidthLimiter {
+    atomic<curl_off_t> rate{ 0 };
+    mutex bucketMutex;
+    double tokens = 0;
+    chrono::steady_clock::time_point refilled = chrono::steady_clock::now();
+};
+
+BandwidthLimiter bandwidthLimiter;
+
+//   :  ,  ,  
+//   429/5xx,     .
+struct ControlSample {
+    atomic<long long> bytes{ 0 };
+    atomic<int> completed{ 0 };
+    atomic<int> throttled{ 0 };
+    atomic<long long> firstByteMicros{ 0 };
+};
+
+ControlSample controlSample;
+
+void ThrottleBandwidth(size_t bytes) {
+    controlSample.bytes += static_cast<long long>(bytes);
+    curl_off_t rate = bandwidthLimiter.rate.load(memory_order_relaxed);
+    if (rate <= 0) {
+        return;
+    }
+    double waitSeconds = 0;
+    {
+        lock_guard<mutex> lock(bandwidthLimiter.bucketMutex);
+        auto now = chrono::steady_clock::now();
+        double burst = max(rate / 10.0, 64.0 * 1024);
+        double elapsed = chrono::duration<double>(now - bandwidthLimiter.refilled).count();
+        bandwidthLimiter.tokens = min(bandwidthLimiter.tokens + elapsed * rate, burst);
+        bandwidthLimiter.refilled = now;
+        bandwidthLimiter.tokens -= static_cast<double>(bytes);
+        if (bandwidthLimiter.tokens < 0) {
+            waitSeconds = -bandwidthLimiter.tokens / rate;
+        }
+    }
+    if (waitSeconds > 0) {
+        this_thread::sleep_for(chrono::duration<double>(waitSeconds));
+    }
+}
+
+void RecordControlSample(CURL* curl, long responseCode) {
+    curl_off_t preTransfer = 0, startTransfer = 0;
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &preTransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &startTransfer);
+    controlSample.completed++;
+    controlSample.firstByteMicros += max<curl_off_t>(startTransfer - preTransfer, 0);
+    if (responseCode == 429 || responseCode >= 500) {
+        controlSample.throttled++;
+    }
+}
+
+struct AdaptiveControl {
+    thread controller;
+    mutex stopMutex;
+    condition_variable stopCondition;
+    bool stopping = false;
+    atomic<bool> automatic{ false };
+    int minLimit = 1;
+    int maxLimit = 1;
+    int lowestLimit = INT_MAX;
+    int highestLimit = 0;
+};
+
+AdaptiveControl adaptiveControl;
+
+// AIMD   : 429/5xx    5%     
+//     -    0.7;   
+// ,        -   1/8.
+//         10%, 
+// .      - , 
+//  .
+void AdaptiveControlLoop() {
+    double previousThroughput = 0;
+    double baselineFirstByte = 0;
+    int lastIncrease = 0;
+    auto lastTick = chrono::steady_clock::now();
+
+    unique_lock<mutex> lock(adaptiveControl.stopMutex);
+    while (!adaptiveControl.stopping) {
+        adaptiveControl.stopCondition.wait_for(lock, chrono::seconds(1));
+        auto now = chrono::steady_clock::now();
+        double seconds = chrono::duration<double>(now - lastTick).count();
+        lastTick = now;
+
+        double throughput = controlSample.bytes.exchange(0) / seconds;
+        int completed = controlSample.completed.exchange(0);
+        int throttled = controlSample.throttled.exchange(0);
+        long long firstByteMicros = controlSample.firstByteMicros.exchange(0);
+        int peak = transferGate.peakInFlight.exchange(transferGate.inFlight.load());
+        if (!adaptiveControl.automatic) {
+            continue;
+        }
+
+        double firstByte = completed > 0 ? static_cast<double>(firstByteMicros) / completed : 0;
+        if (completed > 0) {
+            baselineFirstByte = baselineFirstByte == 0 ? firstByte : min(firstByte, baselineFirstByte * 1.02);
+        }
+
+        int limit = transferGate.limit;
+        int next = limit;
+        const char* reason = nullptr;
+        if (throttled > 0 && throttled * 20 > completed) {
+            next = static_cast<int>(limit * 0.7);
+            reason = "429/5xx";
+        }
+        else if (completed >= 4 && baselineFirstByte > 0 && firstByte > 2 * baselineFirstByte) {
+            next = static_cast<int>(limit * 0.7);
+            reason = "";
+        }
+        else if (lastIncrease > 0 && throughput < previousThroughput * 0.9) {
+            next = limit - lastIncrease;
+            reason = " ";
+        }
+        else if (peak >= limit) {
+            next = limit + max(1, limit / 8);
+            reason = "";
+        }
+        next = max(adaptiveControl.minLimit, min(adaptiveControl.maxLimit, next));
+        lastIncrease = next > limit ? next - limit : 0;
+        previousThroughput = throughput;
+
+        if (next != limit) {
+            SetTransferLimit(next);
+            adaptiveControl.lowestLimit = min(adaptiveControl.lowestLimit, next);
+            adaptiveControl.highestLimit = max(adaptiveControl.highestLimit, next);
+            Log(LogLevel::Info) << "[] " << limit << " -> " << next << " (" << reason << ", "
+                << static_cast<long long>(throughput / 1024) << " KB/s,    "
+                << static_cast<long long>(firstByte / 1000) << " )";
+        }
+    }
+}
+
+void StartAdaptiveControl(int maxLimit, bool automatic) {
+    adaptiveControl.maxLimit = maxLimit;
+    adaptiveControl.automatic = automatic;
+    if (automatic) {
+        int initial = min(maxLimit, 8);
+        SetTransferLimit(initial);
+        adaptiveControl.lowestLimit = adaptiveControl.highestLimit = initial;
+    }
+    adaptiveControl.controller = thread(AdaptiveControlLoop);
+}
+
+void StopAdaptiveControl() {
+    if (!adaptiveControl.controller.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(adaptiveControl.stopMutex);
+        adaptiveControl.stopping = true;
+    }
+    adaptiveControl.stopCondition.notify_one();
+    adaptiveControl.controller.join();
+}
+
+void WakeAllWorkers() {
+    {
+        lock_guard<mutex> lock(qMutex);
+    }
+    condition.notify_all();
+    transferGate.gateCondition.notify_all();
+    {
+        lock_guard<mutex> lock(idleMutex);
+    }
+    idleCondition.notify_all();
+}
+
+//  :       .
+void ReleaseHost(const DownloadTask& task, curl_off_t bytes) {
+    if (workerIndex >= 0) {
+        HostStats& stats = workerQueues[workerIndex]->hostStats[task.host];
+        stats.transfers++;
+        stats.bytes += bytes;
+        stats.firstStart = min(stats.firstStart, task.started);
+        stats.lastFinish = max(stats.lastFinish, chrono::steady_clock::now());
+    }
+    if (UseWorkStealing()) {
+        HostSlot* slot = task.hostSlot;
+        if (!slot || slot->limit <= 0) {
+            return;
+        }
+        slot->inFlight--;
+        if (slot->waiting == 0) {
+            return;
+        }
+        //      :     .
+        DownloadTask* next = nullptr;
+        {
+            lock_guard<mutex> lock(slot->parkedMutex);
+            if (!slot->parked.empty()) {
+                next = slot->parked.front();
+                slot->parked.pop_front();
+                slot->waiting--;
+                parkedTasks--;
+            }
+        }
+        if (next) {
+            PushStealTask(next);
+        }
+        return;
+    }
+    {
+        lock_guard<mutex> lock(qMutex);
+        hostQueues[task.host].inFlight--;
+    }
+    condition.notify_one();
+}
+
+void PrintHostSummary() {
+    unordered_map<string, HostStats> merged;
+    for (const auto& queue : workerQueues) {
+        for (const auto& entry : queue->hostStats) {
+            HostStats& stats = merged[entry.first];
+            stats.transfers += entry.second.transfers;
+            stats.bytes += entry.second.bytes;
+            stats.firstStart = min(stats.firstStart, entry.second.firstStart);
+            stats.lastFinish = max(stats.lastFinish, entry.second.lastFinish);
+        }
+    }
+
+    vector<pair<string, HostStats>> hosts(merged.begin(), merged.end());
+    sort(hosts.begin(), hosts.end(), [](const pair<string, HostStats>& a, const pair<string, HostStats>& b) {
+        return a.second.bytes > b.second.bytes;
+    });
+
+    cout << " (" << hosts.size() << "):" << endl;
+    size_t shown = min(hosts.size(), size_t(20));
+    for (size_t i = 0; i < shown; ++i) {
+        const HostStats& stats = hosts[i].second;
+        double seconds = chrono::duration<double>(stats.lastFinish - stats.firstStart).count();
+        double mb = stats.bytes / (1024.0 * 1024.0);
+        cout << "  " << hosts[i].first << ": " << stats.transfers << " , " << fixed << setprecision(1) << mb << " MB, "
+            << (seconds > 0 ? mb / seconds : 0.0) << " MB/s" << defaultfloat << endl;
+    }
+    if (hosts.size() > shown) {
+        cout << "  ...  " << (hosts.size() - shown) << " more" << endl;
+    }
+}
+
+//    :   (DNS, , TLS,
+//   ,  ,   )   
+//  HDR,    .  -   ,
+//      ;  --metrics   
+//   (Prometheus text  JSON,     .json).
+enum MetricPhase { PhaseDns, PhaseConnect, PhaseTls, PhaseFirstByte, PhaseTotal, PhaseDiskWrite, PhaseCount };
+
+const char* const MetricPhaseNames[PhaseCount] = { "dns", "connect", "tls", "first_byte", "total", "disk_write" };
+
+// -   :   16 - ,
+//  16      (   6%).
+struct LatencyHistogram {
+    static const int SubBuckets = 16;
+    static const int MaxExponent = 35;
+    static const int BucketCount = SubBuckets + (MaxExponent - 3) * SubBuckets;
+
+    atomic<uint64_t> buckets[BucketCount] = {};
+    atomic<uint64_t> count{ 0 };
+    atomic<uint64_t> sum{ 0 };
+    atomic<uint64_t> maxValue{ 0 };
+
+    static int BucketOf(uint64_t micros) {
+        if (micros < SubBuckets) {
+            return static_cast<int>(micros);
+        }
+        int exponent = 63;
+        while (!(micros >> exponent)) exponent--;
+        if (exponent > MaxExponent) {
+            return BucketCount - 1;
+        }
+        return SubBuckets + (exponent - 4) * SubBuckets + static_cast<int>((micros >> (exponent - 4)) & (SubBuckets - 1));
+    }
+
+    static uint64_t BucketUpperBound(int bucket) {
+        if (bucket < SubBuckets) {
+            return bucket;
+        }
+        int exponent = (bucket - SubBuckets) / SubBuckets + 4;
+        uint64_t sub = (bucket - SubBuckets) % SubBuckets;
+        return ((SubBuckets + sub + 1) << (exponent - 4)) - 1;
+    }
+
+    void Record(uint64_t micros) {
+        buckets[BucketOf(micros)].fetch_add(1, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(micros, memory_order_relaxed);
+        uint64_t previous = maxValue.load(memory_order_relaxed);
+        while (micros > previous && !maxValue.compare_exchange_weak(previous, micros, memory_order_relaxed)) {
+        }
+    }
+
+    //   ,     q.
+    uint64_t Quantile(double q) const {
+        uint64_t total = 0;
+        uint64_t counts[BucketCount];
+        for (int i = 0; i < BucketCount; ++i) {
+            counts[i] = buckets[i].load(memory_order_relaxed);
+            total += counts[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+        rank = max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (int i = 0; i < BucketCount; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return min(BucketUpperBound(i), maxValue.load(memory_order_relaxed));
+            }
+        }
+        return maxValue.load(memory_order_relaxed);
+    }
+};
+
+struct HostMetrics {
+    LatencyHistogram phases[PhaseCount];
+    atomic<uint64_t> transfers{ 0 };
+    atomic<uint64_t> failed{ 0 };
+    atomic<uint64_t> bytes{ 0 };
+};
+
+shared_mutex hostMetricsMutex;
+unordered_map<string, unique_ptr<HostMetrics>> hostMetrics;
+
+HostMetrics& MetricsForHost(const string& host) {
+    {
+        shared_lock<shared_mutex> lock(hostMetricsMutex);
+        auto found = hostMetrics.find(host);
+        if (found != hostMetrics.end()) {
+            return *found->second;
+        }
+    }
+    unique_lock<shared_mutex> lock(hostMetricsMutex);
+    unique_ptr<HostMetrics>& metrics = hostMetrics[host];
+    if (!metrics) {
+        metrics.reset(new HostMetrics());
+    }
+    return *metrics;
+}
+
+//    CURLINFO_*_TIME_T (  
+// ,   -   ).
+void RecordTransferMetrics(CURL* curl, const DownloadTask& task, bool ok, curl_off_t bytes, int64_t diskWriteMicros) {
+    curl_off_t lookup = 0, connect = 0, appConnect = 0, preTransfer = 0, startTransfer = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appConnect);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &preTransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &startTransfer);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+    HostMetrics& metrics = MetricsForHost(task.host);
+    metrics.transfers.fetch_add(1, memory_order_relaxed);
+    if (!ok) {
+        metrics.failed.fetch_add(1, memory_order_relaxed);
+    }
+    metrics.bytes.fetch_add(static_cast<uint64_t>(max<curl_off_t>(bytes, 0)), memory_order_relaxed);
+
+    metrics.phases[PhaseDns].Record(lookup);
+    metrics.phases[PhaseConnect].Record(max<curl_off_t>(connect - lookup, 0));
+    if (appConnect > 0) {
+        metrics.phases[PhaseTls].Record(max<curl_off_t>(appConnect - connect, 0));
+    }
+    if (startTransfer > 0) {
+        metrics.phases[PhaseFirstByte].Record(max<curl_off_t>(startTransfer - preTransfer, 0));
+    }
+    metrics.phases[PhaseTotal].Record(total);
+    metrics.phases[PhaseDiskWrite].Record(static_cast<uint64_t>(diskWriteMicros));
+}
+
+//      Prometheus text exposition.
+string MetricsPrometheus() {
+    ostringstream out;
+    out << fixed << setprecision(6);
+    out << "# TYPE downloader_phase_seconds summary\n";
+    out << "# TYPE downloader_transfers_total counter\n";
+    out << "# TYPE downloader_failed_total counter\n";
+    out << "# TYPE downloader_bytes_total counter\n";
+    shared_lock<shared_mutex> lock(hostMetricsMutex);
+    for (const auto& entry : hostMetrics) {
+        const HostMetrics& metrics = *entry.second;
+        string host = "host=\"" + entry.first + "\"";
+        for (int phase = 0; phase < PhaseCount; ++phase) {
+            const LatencyHistogram& histogram = metrics.phases[phase];
+            string labels = host + ",phase=\"" + MetricPhaseNames[phase] + "\"";
+            for (const char* q : { "0.5", "0.99", "0.999" }) {
+                out << "downloader_phase_seconds{" << labels << ",quantile=\"" << q << "\"} "
+                    << histogram.Quantile(atof(q)) / 1e6 << "\n";
+            }
+            out << "downloader_phase_seconds_sum{" << labels << "} " << histogram.sum / 1e6 << "\n";
+            out << "downloader_phase_seconds_count{" << labels << "} " << histogram.count << "\n";
+        }
+        out << "downloader_transfers_total{" << host << "} " << metrics.transfers << "\n";
+        out << "downloader_failed_total{" << host << "} " << metrics.failed << "\n";
+        out << "downloader_bytes_total{" << host << "} " << metrics.bytes << "\n";
+    }
+    return out.str();
+}
+
+string MetricsJson() {
+    ostringstream out;
+    out << fixed << setprecision(3);
+    out << "{\"time\":" << chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count()
+        << ",\"hosts\":{";
+    shared_lock<shared_mutex> lock(hostMetricsMutex);
+    bool firstHost = true;
+    for (const auto& entry : hostMetrics) {
+        const HostMetrics& metrics = *entry.second;
+        string host;
+        AppendJsonString(host, entry.first.data(), entry.first.size());
+        out << (firstHost ? "" : ",") << host << ":{\"transfers\":" << metrics.transfers << ",\"failed\":" << metrics.failed
+            << ",\"bytes\":" << metrics.bytes << ",\"phases_ms\":{";
+        for (int phase = 0; phase < PhaseCount; ++phase) {
+            const LatencyHistogram& histogram = metrics.phases[phase];
+            out << (phase ? "," : "") << "\"" << MetricPhaseNames[phase] << "\":{\"count\":" << histogram.count
+                << ",\"p50\":" << histogram.Quantile(0.5) / 1e3 << ",\"p99\":" << histogram.Quantile(0.99) / 1e3
+                << ",\"p999\":" << histogram.Quantile(0.999) / 1e3 << ",\"max\":" << histogram.maxValue / 1e3 << "}";
+        }
+        out << "}}";
+        firstHost = false;
+    }
+    out << "}}\n";
+    return out.str();
+}
+
+//   ,        .
+void WriteMetricsSnapshot(const string& path) {
+    bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    string snapshot = json ? MetricsJson() : MetricsPrometheus();
+    string tempPath = path + ".tmp";
+    {
+        ofstream out(tempPath, ios::binary | ios::trunc);
+        out << snapshot;
+        if (!out) {
+            return;
+        }
+    }
+    error_code ec;
+    filesystem::rename(tempPath, path, ec);
+}
+
+struct MetricsWriter {
+    thread writer;
+    mutex stopMutex;
+    condition_variable stopCondition;
+    bool stopping = false;
+};
+
+MetricsWriter metricsWriter;
+
+void MetricsWriterLoop(string path, int intervalMs) {
+    unique_lock<mutex> lock(metricsWriter.stopMutex);
+    while (!metricsWriter.stopping) {
+        metricsWriter.stopCondition.wait_for(lock, chrono::milliseconds(intervalMs));
+        lock.unlock();
+        WriteMetricsSnapshot(path);
+        lock.lock();
+    }
+}
+
+void StopMetricsWriter() {
+    if (!metricsWriter.writer.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(metricsWriter.stopMutex);
+        metricsWriter.stopping = true;
+    }
+    metricsWriter.stopCondition.notify_one();
+    metricsWriter.writer.join();
+}
+
+//    :     .
+void PrintLatencySummary() {
+    LatencyHistogram merged[PhaseCount];
+    {
+        shared_lock<shared_mutex> lock(hostMetricsMutex);
+        for (const auto& entry : hostMetrics) {
+            for (int phase = 0; phase < PhaseCount; ++phase) {
+                const LatencyHistogram& source = entry.second->phases[phase];
+                for (int i = 0; i < LatencyHistogram::BucketCount; ++i) {
+                    merged[phase].buckets[i] += source.buckets[i].load(memory_order_relaxed);
+                }
+                merged[phase].count += source.count.load();
+                merged[phase].maxValue = max(merged[phase].maxValue.load(), source.maxValue.load());
+            }
+        }
+    }
+    if (merged[PhaseTotal].count == 0) {
+        return;
+    }
+    cout << ", :" << setw(12) << "p50" << setw(10) << "p99" << setw(10) << "p999" << endl;
+    for (int phase = 0; phase < PhaseCount; ++phase) {
+        if (merged[phase].count == 0) {
+            continue;
+        }
+        cout << "  " << left << setw(12) << MetricPhaseNames[phase] << right << fixed << setprecision(2)
+            << setw(10) << merged[phase].Quantile(0.5) / 1e3 << setw(10) << merged[phase].Quantile(0.99) / 1e3
+            << setw(10) << merged[phase].Quantile(0.999) / 1e3 << defaultfloat << endl;
+    }
+}
+
+//  : append-only     .
+//  "\turl\t": Q -  , S -  ( 
+//     ), P -        ,
+// D -  ( ), F - .    , 
+//       fsync   journalSyncMs.
+struct JournalEntry {
+    char state = 'Q';
+    string tempPath;
+    bool resumable = false;
+    curl_off_t bytes = 0;
+};
+
+struct Journal {
+    FILE* file = nullptr;
+    string path;
+    string buffer;
+    mutex bufferMutex;
+    condition_variable flushCondition;
+    thread flusher;
+    bool stopping = false;
+    unordered_map<string, JournalEntry> entries;
+};
+
+Journal journal;
+
+void JournalSync(FILE* file) {
+    fflush(file);
+#ifdef _WIN32
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+}
+
+void JournalFlushLoop() {
+    auto lastSync = chrono::steady_clock::now();
+    bool dirty = false;
+    string pending;
+
+    unique_lock<mutex> lock(journal.bufferMutex);
+    while (true) {
+        journal.flushCondition.wait_for(lock, chrono::milliseconds(100));
+        bool stopping = journal.stopping;
+        pending.swap(journal.buffer);
+        lock.unlock();
+
+        if (!pending.empty()) {
+            fwrite(pending.data(), 1, pending.size(), journal.file);
+            pending.clear();
+            dirty = true;
+        }
+        auto now = chrono::steady_clock::now();
+        if (dirty && (stopping || now - lastSync >= chrono::milliseconds(options.journalSyncMs))) {
+            JournalSync(journal.file);
+            lastSync = now;
+            dirty = false;
+        }
+
+        lock.lock();
+        if (stopping && journal.buffer.empty()) {
+            break;
+        }
+    }
+}
+
+void LoadJournal(const string& path) {
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        size_t tab1 = line.find('\t');
+        if (line.size() < 3 || tab1 != 1) {
+            continue;
+        }
+        size_t tab2 = line.find('\t', 2);
+        string url = line.substr(2, tab2 == string::npos ? string::npos : tab2 - 2);
+        string data = tab2 == string::npos ? "" : line.substr(tab2 + 1);
+
+        JournalEntry& entry = journal.entries[url];
+        switch (line[0]) {
+        case 'S': {
+            size_t tab3 = data.find('\t');
+            entry.tempPath = data.substr(0, tab3);
+            entry.resumable = tab3 != string::npos && data.compare(tab3 + 1, string::npos, "1") == 0;
+            entry.bytes = 0;
+            break;
+        }
+        case 'P':
+            entry.bytes = strtoll(data.c_str(), nullptr, 10);
+            break;
+        case 'Q':
+        case 'D':
+        case 'F':
+            break;
+        default:
+            continue;
+        }
+        entry.state = line[0];
+    }
+}
+
+bool OpenJournal(const string& path) {
+    journal.path = path;
+    LoadJournal(path);
+
+    journal.file = fopen(path.c_str(), "ab");
+    if (!journal.file) {
+        return false;
+    }
+    journal.flusher = thread(JournalFlushLoop);
+    return true;
+}
+
+void JournalRecord(char state, const string& url, const string& data = string()) {
+    if (!journal.file) {
+        return;
+    }
+    lock_guard<mutex> lock(journal.bufferMutex);
+    journal.buffer += state;
+    journal.buffer += '\t';
+    journal.buffer += url;
+    if (!data.empty()) {
+        journal.buffer += '\t';
+        journal.buffer += data;
+    }
+    journal.buffer += '\n';
+    if (journal.buffer.size() >= 1024 * 1024) {
+        journal.flushCondition.notify_one();
+    }
+}
+
+//        .
+void CloseJournal(bool runComplete) {
+    if (!journal.file) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(journal.bufferMutex);
+        journal.stopping = true;
+    }
+    journal.flushCondition.notify_one();
+    journal.flusher.join();
+    fclose(journal.file);
+    journal.file = nullptr;
+
+    if (runComplete) {
+        error_code ec;
+        filesystem::remove(journal.path, ec);
+    }
+}
+
+//       : "<dir>.journal"  ..
+string SiblingPath(const string& directoryPath, const string& suffix) {
+    string dir = directoryPath;
+    while (dir.size() > 1 && (dir.back() == '/' || dir.back() == '\\')) {
+        dir.pop_back();
+    }
+    return dir + suffix;
+}
+
+string JournalPathFor(const string& directoryPath) {
+    return SiblingPath(directoryPath, ".journal");
+}
+
+//    --dedup: "\t"  ,  -  
+// XXH64 ( SHA-256  --dedup-sha256).    
+// ,   -      ( 
+//  ).     .
+struct ContentIndex {
+    mutex indexMutex;
+    FILE* file = nullptr;
+    unordered_map<string, string> paths;
+};
+
+ContentIndex contentIndex;
+atomic<int> dedupLinkedFiles{ 0 };
+atomic<long long> dedupSavedBytes{ 0 };
+
+bool OpenContentIndex(const string& path) {
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (tab != string::npos && tab > 0) {
+            contentIndex.paths[line.substr(0, tab)] = line.substr(tab + 1);
+        }
+    }
+    contentIndex.file = fopen(path.c_str(), "ab");
+    return contentIndex.file != nullptr;
+}
+
+void CloseContentIndex() {
+    if (contentIndex.file) {
+        fclose(contentIndex.file);
+        contentIndex.file = nullptr;
+    }
+}
+
+string ContentKey(curl_off_t size, const ContentHasher& hasher) {
+    char xxh[17];
+    snprintf(xxh, sizeof(xxh), "%016llx", static_cast<unsigned long long>(hasher.xxh.Digest()));
+    string key = to_string(size) + ":" + xxh;
+    if (hasher.sha256) {
+        key += ":" + hasher.sha.HexDigest();
+    }
+    return key;
+}
+
+//          .
+bool HashFile(const string& path, ContentHasher& hasher) {
+    ifstream in(path, ios::binary);
+    vector<char> chunk(SinkBufferSize);
+    while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0) {
+        hasher.Update(chunk.data(), static_cast<size_t>(in.gcount()));
+    }
+    return in.eof();
+}
+
+bool SameFileContent(const string& left, const string& right) {
+    ifstream a(left, ios::binary);
+    ifstream b(right, ios::binary);
+    vector<char> chunkA(SinkBufferSize);
+    vector<char> chunkB(SinkBufferSize);
+    while (a && b) {
+        a.read(chunkA.data(), chunkA.size());
+        b.read(chunkB.data(), chunkB.size());
+        if (a.gcount() != b.gcount() || memcmp(chunkA.data(), chunkB.data(), static_cast<size_t>(a.gcount())) != 0) {
+            return false;
+        }
+    }
+    return a.eof() && b.eof();
+}
+
+void MoveIntoPlace(const string& from, const string& to, bool replace, error_code& ec) {
+    if (replace) {
+        filesystem::rename(from, to, ec);
+    }
+    else {
+        RenameNoReplace(from, to, ec);
+    }
+}
+
+//     fullPath;    
+//  replace.  --dedup       
+//     .  SHA-256  XXH64
+//    .
+void StoreDownloadedFile(const string& tempPath, const string& fullPath, curl_off_t size, ContentHasher& hasher, bool replace,
+    error_code& ec) {
+    if (!options.dedup) {
+        MoveIntoPlace(tempPath, fullPath, replace, ec);
+        return;
+    }
+
+    if (!hasher.active) {
+        hasher.sha256 = options.dedupSha256;
+        HashFile(tempPath, hasher);
+    }
+    string key = ContentKey(size, hasher);
+
+    //      ,   
+    //         .
+    string existing;
+    {
+        lock_guard<mutex> lock(contentIndex.indexMutex);
+        auto inserted = contentIndex.paths.emplace(key, fullPath);
+        if (!inserted.second) {
+            existing = inserted.first->second;
+        }
+    }
+
+    error_code linkError;
+    if (!existing.empty() && filesystem::file_size(existing, linkError) == static_cast<uintmax_t>(size) && !linkError &&
+        (hasher.sha256 || SameFileContent(tempPath, existing))) {
+        //          .
+        string linkPath = tempPath + ".link";
+        filesystem::create_hard_link(existing, linkPath, linkError);
+        if (!linkError) {
+            MoveIntoPlace(linkPath, fullPath, replace, ec);
+            // rename()         .
+            filesystem::remove(linkPath, linkError);
+            if (ec) {
+                return;
+            }
+            filesystem::remove(tempPath, linkError);
+            dedupLinkedFiles++;
+            dedupSavedBytes += size;
+            return;
+        }
+    }
+
+    MoveIntoPlace(tempPath, fullPath, replace, ec);
+    lock_guard<mutex> lock(contentIndex.indexMutex);
+    if (ec) {
+        if (existing.empty()) {
+            contentIndex.paths.erase(key);
+        }
+        return;
+    }
+    if (!existing.empty()) {
+        return;
+    }
+    if (contentIndex.file) {
+        string line = key + "\t" + fullPath + "\n";
+        fwrite(line.data(), 1, line.size(), contentIndex.file);
+        fflush(contentIndex.file);
+    }
+}
+
+//         ( 
+// replacePath)    .     
+// ,  .
+string PlaceDownloadedFile(const string& tempPath, const filesystem::path& directory, const string& fileName,
+    const string& replacePath, curl_off_t size, ContentHasher& hasher, error_code& ec) {
+    if (!replacePath.empty()) {
+        StoreDownloadedFile(tempPath, replacePath, size, hasher, true, ec);
+        return replacePath;
+    }
+    while (true) {
+        string fullPath = ReserveFileName(directory, fileName);
+        StoreDownloadedFile(tempPath, fullPath, size, hasher, false, ec);
+        if (ec != errc::file_exists) {
+            if (ec) {
+                ReleaseFileName(directory, fullPath);
+            }
+            return fullPath;
+        }
+    }
+}
+
+uint64_t HashBytes(const char* data, size_t size, uint64_t seed = 0) {
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// ,      .
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    // false -  ,     .
+    bool Open(const string& path, bool sequential) {
+        Close();
+#ifdef _WIN32
+        file = CreateFileW(filesystem::path(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+            sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER fileSize{};
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            Close();
+            return false;
+        }
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        data = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        size = static_cast<size_t>(fileSize.QuadPart);
+#else
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st {};
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+            Close();
+            return false;
+        }
+        void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            data = static_cast<const char*>(mapped);
+            size = static_cast<size_t>(st.st_size);
+            madvise(mapped, size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        }
+#endif
+        if (!data) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap(const_cast<char*>(data), size);
+        if (fd >= 0) close(fd);
+        fd = -1;
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+//   ,   : magic  , 
+// ,     u32  ,  lengthsAt - u16  ,
+//   -   .   - URL.
+struct RecordFormat {
+    const char* magic;
+    uint32_t version;
+    size_t fixedSize;
+    size_t lengthsAt;
+    int fields;
+};
+
+const size_t RecordHeaderSize = 8;
+
+uint16_t RecordField(const RecordFormat& format, const char* record, int field) {
+    uint16_t length;
+    memcpy(&length, record + format.lengthsAt + 2 * field, 2);
+    return length;
+}
+
+//  visit        
+// ; 0 -   .
+size_t ScanRecords(const MappedFile& file, const RecordFormat& format, const function<void(size_t)>& visit) {
+    uint32_t version = 0;
+    if (file.size < RecordHeaderSize || memcmp(file.data, format.magic, 4) != 0 ||
+        (memcpy(&version, file.data + 4, 4), version != format.version)) {
+        return 0;
+    }
+    size_t offset = RecordHeaderSize;
+    while (offset + format.fixedSize <= file.size) {
+        uint32_t length;
+        memcpy(&length, file.data + offset, 4);
+        const char* record = file.data + offset;
+        size_t expected = format.fixedSize;
+        for (int field = 0; field < format.fields; ++field) {
+            expected += RecordField(format, record, field);
+        }
+        if (length < format.fixedSize || offset + length > file.size || expected != length) {
+            break;
+        }
+        visit(offset);
+        offset += length;
+    }
+    return offset;
+}
+
+//    .     
+// ,        . 
+//       :   .
+FILE* OpenRecordFile(const string& path, const RecordFormat& format, const char* what) {
+    error_code ec;
+    uintmax_t size = filesystem::file_size(path, ec);
+    if (ec == errc::no_such_file_or_directory || (!ec && size == 0)) {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file && (fwrite(format.magic, 1, 4, file) != 4 || fwrite(&format.version, 4, 1, file) != 1)) {
+            fclose(file);
+            file = nullptr;
+        }
+        if (!file) {
+            Log(LogLevel::Error) << what << " " << path << ":   ";
+        }
+        return file;
+    }
+    if (ec) {
+        Log(LogLevel::Error) << what << " " << path << ": " << ec.message();
+        return nullptr;
+    }
+    size_t valid = 0;
+    {
+        MappedFile mapped;
+        if (!mapped.Open(path, true)) {
+            Log(LogLevel::Error) << what << " " << path << ":   ";
+            return nullptr;
+        }
+        valid = ScanRecords(mapped, format, [](size_t) {});
+    }
+    if (valid == 0) {
+        Log(LogLevel::Error) << what << " " << path << "    ,    ";
+        return nullptr;
+    }
+    if (size != valid) {
+        Log(LogLevel::Warn) << what << " " << path << ":   , " << (size - valid) << " ";
+        filesystem::resize_file(path, valid, ec);
+        if (ec) {
+            Log(LogLevel::Error) << what << " " << path << ": " << ec.message();
+            return nullptr;
+        }
+    }
+    FILE* file = fopen(path.c_str(), "ab");
+    if (!file) {
+        Log(LogLevel::Error) << what << " " << path << ":   ";
+    }
+    return file;
+}
+
+//  ,    URL.
+bool IndexRecordsByUrl(const MappedFile& file, const RecordFormat& format, vector<pair<uint64_t, size_t>>& index) {
+    index.clear();
+    if (ScanRecords(file, format, [&](size_t offset) {
+        index.emplace_back(HashBytes(file.data + offset + format.fixedSize, RecordField(format, file.data + offset, 0)), offset);
+    }) == 0) {
+        return false;
+    }
+    stable_sort(index.begin(), index.end(), [](const pair<uint64_t, size_t>& a, const pair<uint64_t, size_t>& b) {
+        return a.first < b.first;
+    });
+    return true;
+}
+
+//   URL  nullptr.
+const char* FindLastRecord(const MappedFile& file, const RecordFormat& format, const vector<pair<uint64_t, size_t>>& index,
+    const string& url) {
+    const char* found = nullptr;
+    uint64_t hash = HashBytes(url.data(), url.size());
+    auto it = lower_bound(index.begin(), index.end(), make_pair(hash, size_t(0)));
+    for (; it != index.end() && it->first == hash; ++it) {
+        const char* record = file.data + it->second;
+        if (RecordField(format, record, 0) == url.size() && memcmp(record + format.fixedSize, url.data(), url.size()) == 0) {
+            found = record;
+        }
+    }
+    return found;
+}
+
+//    "<dir>.manifest":   URL - ETag,
+// Last-Modified,    .  ,  :
+// "DLMF" + ,  
+//   u32   | u64  | u16  url, etag, last-modified,  | 
+// (RecordFormat).    ,   
+//   ( URL,   ),  
+//  .
+struct ManifestEntry {
+    string etag;
+    string lastModified;
+    string path;
+    curl_off_t size = 0;
+};
+
+struct Manifest {
+    string path;
+    MappedFile mapped;
+    vector<pair<uint64_t, size_t>> index;
+    size_t records = 0;
+
+    mutex fileMutex;
+    FILE* file = nullptr;
+
+    //   ,   ,   .
+    bool live = false;
+    shared_mutex recentMutex;
+    unordered_map<string, ManifestEntry> recent;
+};
+
+Manifest manifest;
+atomic<int> notModifiedTasks{ 0 };
+
+const RecordFormat ManifestFormat = { "DLMF", 1, 4 + 8 + 4 * 2, 12, 4 };
+
+uint16_t ManifestField(const char* record, int field) {
+    return RecordField(ManifestFormat, record, field);
+}
+
+//     ; false -   .
+bool IndexManifest(const MappedFile& file, vector<pair<uint64_t, size_t>>& index, size_t& records) {
+    records = 0;
+    if (!IndexRecordsByUrl(file, ManifestFormat, index)) {
+        return false;
+    }
+    records = index.size();
+
+    //   URL   .
+    vector<pair<uint64_t, size_t>> latest;
+    latest.reserve(index.size());
+    for (const auto& item : index) {
+        const char* record = file.data + item.second;
+        if (!latest.empty() && latest.back().first == item.first) {
+            const char* previous = file.data + latest.back().second;
+            if (ManifestField(previous, 0) == ManifestField(record, 0) &&
+                memcmp(previous + ManifestFormat.fixedSize, record + ManifestFormat.fixedSize, ManifestField(record, 0)) == 0) {
+                latest.back().second = item.second;
+                continue;
+            }
+        }
+        latest.push_back(item);
+    }
+    index.swap(latest);
+    return true;
+}
+
+//       ,   
+//      .
+bool OpenManifest(const string& path) {
+    manifest.path = path;
+    manifest.file = OpenRecordFile(path, ManifestFormat, "");
+    if (!manifest.file) {
+        return false;
+    }
+    fflush(manifest.file);
+    if (manifest.mapped.Open(path, false) && !IndexManifest(manifest.mapped, manifest.index, manifest.records)) {
+        manifest.mapped.Close();
+    }
+    return true;
+}
+
+bool FindManifestEntry(const string& url, ManifestEntry& entry) {
+    if (manifest.live) {
+        shared_lock<shared_mutex> lock(manifest.recentMutex);
+        auto recent = manifest.recent.find(url);
+        if (recent != manifest.recent.end()) {
+            entry = recent->second;
+            return true;
+        }
+    }
+    uint64_t hash = HashBytes(url.data(), url.size());
+    auto it = lower_bound(manifest.index.begin(), manifest.index.end(), make_pair(hash, size_t(0)));
+    for (; it != manifest.index.end() && it->first == hash; ++it) {
+        const char* record = manifest.mapped.data + it->second;
+        const char* field = record + ManifestFormat.fixedSize;
+        if (url.size() != ManifestField(record, 0) || memcmp(field, url.data(), url.size()) != 0) {
+            continue;
+        }
+        field += ManifestField(record, 0);
+        entry.etag.assign(field, ManifestField(record, 1));
+        field += ManifestField(record, 1);
+        entry.lastModified.assign(field, ManifestField(record, 2));
+        field += ManifestField(record, 2);
+        entry.path.assign(field, ManifestField(record, 3));
+        memcpy(&entry.size, record + 4, 8);
+        return true;
+    }
+    return false;
+}
+
+void AppendManifestRecord(string& out, const string& url, const ManifestEntry& entry) {
+    const string* fields[4] = { &url, &entry.etag, &entry.lastModified, &entry.path };
+    uint32_t length = static_cast<uint32_t>(ManifestFormat.fixedSize);
+    for (const string* field : fields) {
+        length += static_cast<uint32_t>(field->size());
+    }
+    int64_t size = entry.size;
+    out.append(reinterpret_cast<const char*>(&length), 4);
+    out.append(reinterpret_cast<const char*>(&size), 8);
+    for (const string* field : fields) {
+        uint16_t fieldLength = static_cast<uint16_t>(field->size());
+        out.append(reinterpret_cast<const char*>(&fieldLength), 2);
+    }
+    for (const string* field : fields) {
+        out += *field;
+    }
+}
+
+//    .   ETag  Last-Modified  .
+void ManifestRecord(const string& url, const ManifestEntry& entry) {
+    if (!manifest.file || (entry.etag.empty() && entry.lastModified.empty()) ||
+        url.size() > 0xffff || entry.etag.size() > 0xffff || entry.lastModified.size() > 0xffff || entry.path.size() > 0xffff) {
+        return;
+    }
+    if (manifest.live) {
+        unique_lock<shared_mutex> lock(manifest.recentMutex);
+        manifest.recent[url] = entry;
+    }
+    string record;
+    AppendManifestRecord(record, url, entry);
+    lock_guard<mutex> lock(manifest.fileMutex);
+    fwrite(record.data(), 1, record.size(), manifest.file);
+}
+
+//    ,  ,  .
+void CloseManifest() {
+    if (!manifest.file) {
+        return;
+    }
+    fclose(manifest.file);
+    manifest.file = nullptr;
+    manifest.mapped.Close();
+    manifest.index.clear();
+
+    MappedFile file;
+    vector<pair<uint64_t, size_t>> index;
+    size_t records = 0;
+    if (!file.Open(manifest.path, true) || !IndexManifest(file, index, records) || records <= 2 * index.size()) {
+        return;
+    }
+    sort(index.begin(), index.end(), [](const pair<uint64_t, size_t>& a, const pair<uint64_t, size_t>& b) {
+        return a.second < b.second;
+    });
+    string compacted(ManifestFormat.magic, 4);
+    compacted.append(reinterpret_cast<const char*>(&ManifestFormat.version), 4);
+    for (const auto& item : index) {
+        uint32_t length;
+        memcpy(&length, file.data + item.second, 4);
+        compacted.append(file.data + item.second, length);
+    }
+    file.Close();
+
+    string tempPath = manifest.path + ".tmp";
+    FILE* out = fopen(tempPath.c_str(), "wb");
+    if (!out) {
+        return;
+    }
+    bool ok = fwrite(compacted.data(), 1, compacted.size(), out) == compacted.size();
+    ok = fclose(out) == 0 && ok;
+    error_code ec;
+    if (ok) {
+        filesystem::rename(tempPath, manifest.path, ec);
+    }
+    if (!ok || ec) {
+        filesystem::remove(tempPath, ec);
+    }
+}
+
+//  URL   ,  .
+bool ReadUrlLine(string& url) {
+    while (getline(cin, url)) {
+        if (!url.empty() && url.back() == '\r') {
+            url.pop_back();
+        }
+        if (!url.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//    (--fanout=N):    N  
+//  ,   -   URL ("<dir>/3f/a2/"), 
+//         256   
+//   .    URL,   "<dir>.files", 
+//   . :
+//   u32   | u64  | u8  | u16  url,  | 
+//  -     '/',   - .
+//   URL   .
+struct FileIndex {
+    mutex fileMutex;
+    FILE* file = nullptr;
+    string base;
+};
+
+FileIndex fileIndex;
+
+const RecordFormat FileIndexFormat = { "DLFI", 1, 4 + 8 + 1 + 2 * 2, 13, 2 };
+
+filesystem::path OutputDirectory(const string& directoryPath, const string& url) {
+    filesystem::path directory(directoryPath);
+    uint64_t hash = HashBytes(url.data(), url.size());
+    for (int level = 0; level < options.fanoutDepth; ++level) {
+        char name[3];
+        snprintf(name, sizeof(name), "%02x", static_cast<unsigned>((hash >> (56 - 8 * level)) & 0xff));
+        directory /= name;
+    }
+    return directory;
+}
+
+bool OpenFileIndex(const string& path, const string& base) {
+    fileIndex.base = base;
+    fileIndex.file = OpenRecordFile(path, FileIndexFormat, " ");
+    return fileIndex.file != nullptr;
+}
+
+void CloseFileIndex() {
+    if (fileIndex.file) {
+        fclose(fileIndex.file);
+        fileIndex.file = nullptr;
+    }
+}
+
+//   : 'D' -   , 'F' -   .
+void FileIndexRecord(const string& url, const string& fullPath, bool success) {
+    if (!fileIndex.file) {
+        return;
+    }
+    string path;
+    int64_t size = 0;
+    if (success) {
+        error_code ec;
+        uintmax_t stored = filesystem::file_size(fullPath, ec);
+        size = ec ? 0 : static_cast<int64_t>(stored);
+        path = fileIndex.base.empty() ? fullPath
+            : filesystem::path(fullPath).lexically_relative(fileIndex.base).generic_string();
+    }
+    if (url.size() > 0xffff || path.size() > 0xffff) {
+        return;
+    }
+    uint32_t length = static_cast<uint32_t>(FileIndexFormat.fixedSize + url.size() + path.size());
+    char state = success ? 'D' : 'F';
+    uint16_t lengths[2] = { static_cast<uint16_t>(url.size()), static_cast<uint16_t>(path.size()) };
+    string record;
+    record.reserve(length);
+    record.append(reinterpret_cast<const char*>(&length), 4);
+    record.append(reinterpret_cast<const char*>(&size), 8);
+    record += state;
+    record.append(reinterpret_cast<const char*>(lengths), 4);
+    record += url;
+    record += path;
+    lock_guard<mutex> lock(fileIndex.fileMutex);
+    fwrite(record.data(), 1, record.size(), fileIndex.file);
+}
+
+// --lookup=<dir>:   URL    
+// "url<TAB><TAB><TAB>"   "<dir>.files";
+// URL,    ,    "-".
+int RunLookup() {
+    string path = SiblingPath(options.lookupDirectory, ".files");
+    MappedFile file;
+    vector<pair<uint64_t, size_t>> index;
+    if (!file.Open(path, false) || !IndexRecordsByUrl(file, FileIndexFormat, index)) {
+        cerr << ":      " << path << endl;
+        return 1;
+    }
+
+    string url;
+    while (ReadUrlLine(url)) {
+        const char* found = FindLastRecord(file, FileIndexFormat, index, url);
+        if (!found) {
+            cout << url << "\t-\n";
+            continue;
+        }
+        int64_t size;
+        memcpy(&size, found + 4, 8);
+        cout << url << "\t" << (found[12] == 'D' ? "ok" : "failed") << "\t" << size << "\t";
+        cout.write(found + FileIndexFormat.fixedSize + RecordField(FileIndexFormat, found, 0), RecordField(FileIndexFormat, found, 1));
+        cout << "\n";
+    }
+    cout.flush();
+    return 0;
+}
+
+string ResolveFileName(const ResponseData& response) {
+    string filename;
+
+    if (!response.contentDisposition.empty()) {
+        filename = ExtractFileName(response.contentDisposition);
+    }
+
+    if (filename.empty()) {
+        filename = ExtractFileNameFromUrl(response.task->url);
+    }
+
+    return ReplaceUnvalidName(filename);
+}
+
+bool EnsureDirectory(const filesystem::path& dirpath, int taskId) {
+    error_code ec;
+    if (!filesystem::exists(dirpath, ec)) {
+        //       .
+        if (!filesystem::create_directories(dirpath, ec) && !filesystem::is_directory(dirpath, ec)) {
+            Log(LogLevel::Error, taskId) << "   : " << ec.message();
+            return false;
+        }
+    }
+    return true;
+}
+
+//     .      
+// (SinkBufferSize)   ,      .
+//    ,    --memory-budget;  
+// ,    multi    (CURL_WRITEFUNC_PAUSE)
+//  ,   ,    threads  .
+struct ChunkPool {
+    mutex poolMutex;
+    condition_variable poolCondition;
+    vector<char*> freeChunks;
+    size_t allocated = 0;
+    size_t peakAllocated = 0;
+};
+
+ChunkPool chunkPool;
+atomic<long long> chunkHits{ 0 };
+atomic<long long> chunkMisses{ 0 };
+atomic<long long> pausedWrites{ 0 };
+
+//   ,   ,    .
+enum class ChunkWait { No, Yes, Force };
+
+size_t ChunkLimit() {
+    return static_cast<size_t>(options.memoryBudget) / SinkBufferSize;
+}
+
+//  count     .
+bool AcquireChunks(vector<PooledChunk>& out, size_t count, ChunkWait wait) {
+    size_t reused;
+    size_t fresh;
+    vector<char*> taken;
+    {
+        unique_lock<mutex> lock(chunkPool.poolMutex);
+        auto fits = [count] {
+            size_t room = chunkPool.allocated < ChunkLimit() ? ChunkLimit() - chunkPool.allocated : 0;
+            return chunkPool.freeChunks.size() + room >= count;
+        };
+        if (wait == ChunkWait::Yes) {
+            chunkPool.poolCondition.wait(lock, fits);
+        }
+        else if (wait == ChunkWait::No && !fits()) {
+            return false;
+        }
+        reused = min(count, chunkPool.freeChunks.size());
+        taken.assign(chunkPool.freeChunks.end() - reused, chunkPool.freeChunks.end());
+        chunkPool.freeChunks.resize(chunkPool.freeChunks.size() - reused);
+        fresh = count - reused;
+        chunkPool.allocated += fresh;
+        chunkPool.peakAllocated = max(chunkPool.peakAllocated, chunkPool.allocated);
+    }
+    chunkHits += static_cast<long long>(reused);
+    chunkMisses += static_cast<long long>(fresh);
+    for (char* chunk : taken) {
+        out.emplace_back(chunk);
+    }
+    for (size_t i = 0; i < fresh; ++i) {
+        out.emplace_back(new char[SinkBufferSize]);
+    }
+    return true;
+}
+
+void ChunkDeleter::operator()(char* chunk) const {
+    {
+        lock_guard<mutex> lock(chunkPool.poolMutex);
+        //    (ChunkWait::Force)    .
+        if (chunkPool.allocated <= ChunkLimit()) {
+            chunkPool.freeChunks.push_back(chunk);
+            chunk = nullptr;
+        }
+        else {
+            chunkPool.allocated--;
+        }
+    }
+    delete[] chunk;
+    chunkPool.poolCondition.notify_all();
+}
+
+bool ChunksAvailable() {
+    lock_guard<mutex> lock(chunkPool.poolMutex);
+    return !chunkPool.freeChunks.empty() || chunkPool.allocated < ChunkLimit();
+}
+
+//  .     :     
+//  SinkBufferSize,        .
+//  (       Content-Length),
+// ,   ,     (  , ,
+//  ),   .     
+// :       ,    .
+//  Linux        io_uring  
+// ;  io_uring ( , seccomp, --writer=threads)  
+//    pwrite.
+const unsigned WriterRingDepth = 64;
+
+struct DiskOp {
+    enum Kind : uint8_t { Open, Write, Close, Notify } kind = Write;
+    PooledChunk data;
+    size_t size = 0;
+    // Write - ; Close -      (-1 -  ).
+    curl_off_t offset = 0;
+    // Close:   , Notify -   ,  
+    //  ; true -       .
+    function<void(bool)> done;
+};
+
+struct DiskFile {
+    string path;
+    int taskId = 0;
+    bool append = false;
+    curl_off_t preallocate = 0;
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+    atomic<bool> failed{ false };
+
+    //  writerMutex.
+    deque<DiskOp> ops;
+    bool ready = false;
+};
+
+#ifdef HAVE_IO_URING
+//  io_uring  liburing: io_uring_setup,  mmap  io_uring_enter.
+struct UringQueue {
+    int fd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+};
+
+void CloseUring(UringQueue& ring) {
+    if (ring.sqes != MAP_FAILED) {
+        munmap(ring.sqes, ring.sqesSize);
+    }
+    if (ring.cqRing != MAP_FAILED && ring.cqRing != ring.sqRing) {
+        munmap(ring.cqRing, ring.cqRingSize);
+    }
+    if (ring.sqRing != MAP_FAILED) {
+        munmap(ring.sqRing, ring.sqRingSize);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    ring = UringQueue();
+}
+
+bool SetupUring(UringQueue& ring, unsigned entries) {
+    io_uring_params params{};
+    ring.fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring.fd < 0) {
+        return false;
+    }
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        ring.sqRingSize = ring.cqRingSize = max(ring.sqRingSize, ring.cqRingSize);
+    }
+    ring.sqRing = mmap(nullptr, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cqRing = single ? ring.sqRing :
+        mmap(nullptr, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring.sqes = static_cast<io_uring_sqe*>(mmap(nullptr, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQES));
+    if (ring.sqRing == MAP_FAILED || ring.cqRing == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        CloseUring(ring);
+        return false;
+    }
+    char* sq = static_cast<char*>(ring.sqRing);
+    char* cq = static_cast<char*>(ring.cqRing);
+    ring.sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring.sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring.cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+#endif
+
+struct DiskWriter {
+    mutex writerMutex;
+    condition_variable writerCondition;
+    deque<shared_ptr<DiskFile>> readyFiles;
+    bool stopping = false;
+    atomic<bool> uring{ false };
+    vector<thread> threads;
+#ifdef HAVE_IO_URING
+    vector<UringQueue> rings;
+#endif
+};
+
+DiskWriter diskWriter;
+atomic<long long> diskWriteBatches{ 0 };
+atomic<long long> diskWriteOps{ 0 };
+
+//      :    -  ,  
+//   .
+void QueueDiskOp(const shared_ptr<DiskFile>& file, DiskOp op) {
+    lock_guard<mutex> lock(diskWriter.writerMutex);
+    file->ops.push_back(move(op));
+    if (!file->ready) {
+        file->ready = true;
+        diskWriter.readyFiles.push_back(file);
+        diskWriter.writerCondition.notify_one();
+    }
+}
+
+shared_ptr<DiskFile> OpenDiskFile(const string& path, int taskId, bool append, curl_off_t preallocate) {
+    auto file = make_shared<DiskFile>();
+    file->path = path;
+    file->taskId = taskId;
+    file->append = append;
+    file->preallocate = preallocate;
+    DiskOp op;
+    op.kind = DiskOp::Open;
+    QueueDiskOp(file, move(op));
+    return file;
+}
+
+void WriteDiskFile(const shared_ptr<DiskFile>& file, PooledChunk data, size_t size, curl_off_t offset) {
+    DiskOp op;
+    op.kind = DiskOp::Write;
+    op.data = move(data);
+    op.size = size;
+    op.offset = offset;
+    QueueDiskOp(file, move(op));
+}
+
+void CloseDiskFile(const shared_ptr<DiskFile>& file, curl_off_t size, function<void(bool)> done) {
+    DiskOp op;
+    op.kind = DiskOp::Close;
+    op.offset = size;
+    op.done = move(done);
+    QueueDiskOp(file, move(op));
+}
+
+void NotifyDiskFile(const shared_ptr<DiskFile>& file, function<void(bool)> done) {
+    DiskOp op;
+    op.kind = DiskOp::Notify;
+    op.done = move(done);
+    QueueDiskOp(file, move(op));
+}
+
+//  - ,    .
+void DoDiskOpen(DiskFile& file) {
+    if (!EnsureDirectory(filesystem::path(file.path).parent_path(), file.taskId)) {
+        file.failed = true;
+        return;
+    }
+#ifdef _WIN32
+    file.handle = CreateFileW(filesystem::path(file.path).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+        file.append ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    bool opened = file.handle != INVALID_HANDLE_VALUE;
+    if (opened && file.preallocate > 0) {
+        LARGE_INTEGER size;
+        size.QuadPart = file.preallocate;
+        opened = SetFilePointerEx(file.handle, size, nullptr, FILE_BEGIN) && SetEndOfFile(file.handle);
+    }
+#else
+    file.fd = open(file.path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (file.append ? 0 : O_TRUNC), 0644);
+    bool opened = file.fd >= 0;
+    if (opened && file.preallocate > 0) {
+#ifdef __linux__
+        opened = posix_fallocate(file.fd, 0, file.preallocate) == 0 || ftruncate(file.fd, file.preallocate) == 0;
+#else
+        opened = ftruncate(file.fd, file.preallocate) == 0;
+#endif
+    }
+#endif
+    if (!opened) {
+        Log(LogLevel::Error, file.taskId) << "    " << file.path;
+        file.failed = true;
+    }
+}
+
+bool DoDiskWrite(DiskFile& file, const char* data, size_t size, curl_off_t offset) {
+#ifdef _WIN32
+    OVERLAPPED ov{};
+    ov.Offset = static_cast<DWORD>(offset);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD written = 0;
+    return WriteFile(file.handle, data, static_cast<DWORD>(size), &written, &ov) && written == size;
+#else
+    while (size > 0) {
+        ssize_t written = pwrite(file.fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+#endif
+}
+
+void DoDiskClose(DiskFile& file, DiskOp& op) {
+    bool ok = !file.failed;
+#ifdef _WIN32
+    if (file.handle != INVALID_HANDLE_VALUE) {
+        if (ok && op.offset >= 0 && file.preallocate > 0) {
+            LARGE_INTEGER size;
+            size.QuadPart = op.offset;
+            ok = SetFilePointerEx(file.handle, size, nullptr, FILE_BEGIN) && SetEndOfFile(file.handle);
+        }
+        ok = CloseHandle(file.handle) && ok;
+        file.handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (file.fd >= 0) {
+        if (ok && op.offset >= 0 && file.preallocate > 0) {
+            ok = ftruncate(file.fd, op.offset) == 0;
+        }
+        ok = close(file.fd) == 0 && ok;
+        file.fd = -1;
+    }
+#endif
+    if (op.done) {
+        op.done(ok);
+    }
+}
+
+struct PendingWrite {
+    DiskFile* file;
+    DiskOp* op;
+};
+
+#ifdef HAVE_IO_URING
+//   ;    .
+size_t ReapUringCompletions(UringQueue& ring, vector<PendingWrite>& batch) {
+    size_t reaped = 0;
+    unsigned head = *ring.cqHead;
+    unsigned cqTail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != cqTail; ++head) {
+        const io_uring_cqe& cqe = ring.cqes[head & ring.cqMask];
+        PendingWrite& write = batch[cqe.user_data];
+        size_t written = cqe.res > 0 ? static_cast<size_t>(cqe.res) : 0;
+        //       (EINVAL   
+        // IORING_OP_WRITE)  pwrite,   - .
+        if (cqe.res < 0 && cqe.res != -EINVAL && cqe.res != -EAGAIN && cqe.res != -EINTR) {
+            write.file->failed = true;
+        }
+        else if (written < write.op->size && !DoDiskWrite(*write.file, write.op->data.get() + written,
+            write.op->size - written, write.op->offset + static_cast<curl_off_t>(written))) {
+            write.file->failed = true;
+        }
+        write.op->data.reset();
+        reaped++;
+    }
+    __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// io_uring_enter :    . ,  
+//  ,      -   ; 
+//    ,   pwrite.    ,
+//    ( ),    .
+void AbandonUring(UringQueue& ring, vector<PendingWrite>& batch, unsigned first, size_t completed, int error) {
+    diskWriter.uring = false;
+    size_t consumed = min<size_t>(__atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) - first, batch.size());
+    while (completed < consumed) {
+        size_t reaped = ReapUringCompletions(ring, batch);
+        completed += reaped;
+        if (completed >= consumed || reaped > 0) {
+            continue;
+        }
+        int entered = static_cast<int>(syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < batch.size(); ++i) {
+        PendingWrite& write = batch[i];
+        if (!write.op->data) {
+            continue;
+        }
+        if (i < consumed) {
+            write.file->failed = true;
+            write.op->data.release();
+        }
+        else if (!write.file->failed && !DoDiskWrite(*write.file, write.op->data.get(), write.op->size, write.op->offset)) {
+            write.file->failed = true;
+        }
+    }
+    Log(LogLevel::Warn) << "io_uring  (" << strerror(error) << "),    ";
+}
+#endif
+
+//    :       .
+void FlushDiskWrites(vector<PendingWrite>& batch, void* ringPointer) {
+    if (batch.empty()) {
+        return;
+    }
+    diskWriteBatches++;
+    diskWriteOps += static_cast<long long>(batch.size());
+#ifdef HAVE_IO_URING
+    if (UringQueue* ring = static_cast<UringQueue*>(ringPointer)) {
+        unsigned first = *ring->sqTail;
+        unsigned tail = first;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            unsigned index = tail & ring->sqMask;
+            io_uring_sqe& sqe = ring->sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITE;
+            sqe.fd = batch[i].file->fd;
+            sqe.addr = reinterpret_cast<uint64_t>(batch[i].op->data.get());
+            sqe.len = static_cast<uint32_t>(batch[i].op->size);
+            sqe.off = static_cast<uint64_t>(batch[i].op->offset);
+            sqe.user_data = i;
+            ring->sqArray[index] = index;
+            tail++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        unsigned toSubmit = static_cast<unsigned>(batch.size());
+        size_t completed = 0;
+        while (completed < batch.size()) {
+            int entered = static_cast<int>(syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+            if (entered < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    continue;
+                }
+                int error = errno;
+                AbandonUring(*ring, batch, first, completed + ReapUringCompletions(*ring, batch), error);
+                break;
+            }
+            toSubmit -= min<unsigned>(toSubmit, static_cast<unsigned>(entered));
+            completed += ReapUringCompletions(*ring, batch);
+        }
+        batch.clear();
+        return;
+    }
+#endif
+    for (PendingWrite& write : batch) {
+        if (!write.file->failed && !DoDiskWrite(*write.file, write.op->data.get(), write.op->size, write.op->offset)) {
+            write.file->failed = true;
+        }
+    }
+    batch.clear();
+}
+
+void DiskWriterLoop(int index) {
+    void* ring = nullptr;
+#ifdef HAVE_IO_URING
+    if (diskWriter.uring) {
+        ring = &diskWriter.rings[index];
+    }
+#endif
+    vector<shared_ptr<DiskFile>> files;
+    vector<deque<DiskOp>> ops;
+    vector<PendingWrite> batch;
+    while (true) {
+        {
+            unique_lock<mutex> lock(diskWriter.writerMutex);
+            diskWriter.writerCondition.wait(lock, [] { return !diskWriter.readyFiles.empty() || diskWriter.stopping; });
+            if (diskWriter.readyFiles.empty()) {
+                break;
+            }
+            //       ,  -  .
+            size_t take = ring ? WriterRingDepth : 1;
+            while (!diskWriter.readyFiles.empty() && files.size() < take) {
+                files.push_back(move(diskWriter.readyFiles.front()));
+                diskWriter.readyFiles.pop_front();
+                ops.emplace_back();
+                ops.back().swap(files.back()->ops);
+            }
+            if (!diskWriter.readyFiles.empty()) {
+                diskWriter.writerCondition.notify_one();
+            }
+        }
+        //   (    ) -  ,   .
+        if (ring && !diskWriter.uring) {
+#ifdef HAVE_IO_URING
+            CloseUring(*static_cast<UringQueue*>(ring));
+#endif
+            ring = nullptr;
+        }
+
+        for (size_t i = 0; i < files.size(); ++i) {
+            DiskFile& file = *files[i];
+            for (DiskOp& op : ops[i]) {
+                if (op.kind == DiskOp::Write) {
+                    if (!file.failed) {
+                        batch.push_back(PendingWrite{ &file, &op });
+                        if (batch.size() >= WriterRingDepth) {
+                            FlushDiskWrites(batch, ring);
+                        }
+                    }
+                    continue;
+                }
+                //  -    ,    .
+                FlushDiskWrites(batch, ring);
+                if (op.kind == DiskOp::Open) {
+                    DoDiskOpen(file);
+                }
+                else if (op.kind == DiskOp::Close) {
+                    DoDiskClose(file, op);
+                }
+                else {
+                    op.done(!file.failed);
+                }
+            }
+        }
+        FlushDiskWrites(batch, ring);
+
+        {
+            lock_guard<mutex> lock(diskWriter.writerMutex);
+            for (auto& file : files) {
+                if (file->ops.empty()) {
+                    file->ready = false;
+                }
+                else {
+                    diskWriter.readyFiles.push_back(file);
+                    diskWriter.writerCondition.notify_one();
+                }
+            }
+        }
+        files.clear();
+        ops.clear();
+    }
+}
+
+void StartDiskWriter() {
+    diskWriter.stopping = false;
+    diskWriter.uring = false;
+#ifdef HAVE_IO_URING
+    if (options.writer == "uring") {
+        diskWriter.rings.resize(options.writerThreads);
+        diskWriter.uring = true;
+        for (UringQueue& ring : diskWriter.rings) {
+            if (!SetupUring(ring, WriterRingDepth)) {
+                diskWriter.uring = false;
+            }
+        }
+        if (!diskWriter.uring) {
+            Log(LogLevel::Warn) << "io_uring ,    ";
+            for (UringQueue& ring : diskWriter.rings) {
+                CloseUring(ring);
+            }
+            diskWriter.rings.clear();
+        }
+    }
+#endif
+    for (int i = 0; i < options.writerThreads; ++i) {
+        diskWriter.threads.emplace_back(DiskWriterLoop, i);
+    }
+}
+
+//  ,    ,    .
+void StopDiskWriter() {
+    {
+        lock_guard<mutex> lock(diskWriter.writerMutex);
+        diskWriter.stopping = true;
+    }
+    diskWriter.writerCondition.notify_all();
+    for (auto& t : diskWriter.threads) {
+        t.join();
+    }
+    diskWriter.threads.clear();
+#ifdef HAVE_IO_URING
+    for (UringQueue& ring : diskWriter.rings) {
+        CloseUring(ring);
+    }
+    diskWriter.rings.clear();
+#endif
+}
+
+const char* DiskWriterName() {
+    return diskWriter.uring ? "io_uring" : " ";
+}
+
+// --store-zstd:         
+// "<>.zst";    -  "<dir>.zstindex" 
+// "\t\t " (    ).
+//      :     .
+struct StoredSizeIndex {
+    mutex indexMutex;
+    FILE* file = nullptr;
+};
+
+StoredSizeIndex storedSizeIndex;
+atomic<int> compressedFiles{ 0 };
+atomic<long long> compressedLogicalBytes{ 0 };
+atomic<long long> compressedStoredBytes{ 0 };
+
+bool OpenStoredSizeIndex(const string& path) {
+    storedSizeIndex.file = fopen(path.c_str(), "ab");
+    return storedSizeIndex.file != nullptr;
+}
+
+void CloseStoredSizeIndex() {
+    if (storedSizeIndex.file) {
+        fclose(storedSizeIndex.file);
+        storedSizeIndex.file = nullptr;
+    }
+}
+
+void RecordStoredSize(const string& path, curl_off_t logical, curl_off_t stored) {
+    compressedFiles++;
+    compressedLogicalBytes += logical;
+    compressedStoredBytes += stored;
+    if (!storedSizeIndex.file) {
+        return;
+    }
+    string line = path + "\t" + to_string(logical) + "\t" + to_string(stored) + "\n";
+    lock_guard<mutex> lock(storedSizeIndex.indexMutex);
+    fwrite(line.data(), 1, line.size(), storedSizeIndex.file);
+    fflush(storedSizeIndex.file);
+}
+
+//      .
+bool IsIncompressibleType(const string& contentType) {
+    static const char* const types[] = { "image/", "video/", "audio/", "font/woff", "application/zip",
+        "application/gzip", "application/x-gzip", "application/zstd", "application/x-xz", "application/x-bzip2",
+        "application/x-7z-compressed", "application/x-rar", "application/pdf" };
+    string type = contentType;
+    transform(type.begin(), type.end(), type.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    if (type.compare(0, 9, "image/svg") == 0) {
+        return false;
+    }
+    for (const char* prefix : types) {
+        if (type.compare(0, strlen(prefix), prefix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ShouldCompressAtRest(const ResponseData& response) {
+    return options.storeZstdLevel > 0 && !response.task->segmented && response.task->resumePath.empty() &&
+        !IsIncompressibleType(response.contentType);
+}
+
+bool OpenCompressor(ResponseData& response) {
+#ifdef HAVE_ZSTD
+    response.zstd.reset(ZSTD_createCCtx());
+    if (!response.zstd) {
+        return false;
+    }
+    ZSTD_CCtx_setParameter(response.zstd.get(), ZSTD_c_compressionLevel, options.storeZstdLevel);
+    //    zstd       ,
+    //    :       .
+    if (response.contentLength >= 0 && response.contentEncoding.empty()) {
+        ZSTD_CCtx_setPledgedSrcSize(response.zstd.get(), static_cast<unsigned long long>(response.contentLength));
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+//  (--pack[=]):   ,  PackObjectMax, 
+//   ,    
+// "<dir>/pack-NNNNNN.pack".      ,  
+//     ,  ;   , 
+//   packSegmentSize.  - "DLPK"  ,  
+//   u32   | u64   | u16  url,  |  | 
+//  "<dir>.packs" (RecordFormat) ,    :
+//   u32   | u32   | u64   | u64  |
+//   u16  url,  | 
+//     --extract.
+const curl_off_t PackObjectMax = 1024 * 1024;
+const char PackMagic[4] = { 'D', 'L', 'P', 'K' };
+const uint32_t PackVersion = 1;
+const size_t PackRecordFixedSize = 4 + 8 + 2 * 2;
+const RecordFormat PackIndexFormat = { "DLPI", 1, 4 + 4 + 8 + 8 + 2 * 2, 24, 2 };
+
+// ,           ;
+//          ,  .
+bool ShouldPack(const ResponseData& response) {
+    const DownloadTask& task = *response.task;
+    return options.packSegmentSize > 0 && task.resumePath.empty() && response.cachedPath.empty() && !response.compressed &&
+        (response.contentLength <= PackObjectMax || !response.contentEncoding.empty()) &&
+        PackRecordFixedSize + task.url.size() + response.fileName.size() <= SinkBufferSize;
+}
+
+void OpenTempSink(ResponseData& response) {
+    const DownloadTask& task = *response.task;
+    filesystem::path dirpath = OutputDirectory(task.job->directoryPath, task.url);
+
+    // 206   -    ,     .
+    bool append = !task.resumePath.empty() && response.responseCode == 206;
+    if (!task.resumePath.empty()) {
+        response.tempPath = task.resumePath;
+    }
+    else {
+        response.tempPath = (dirpath / ("." + response.fileName + "." + to_string(task.taskId) + ".part")).string();
+    }
+
+    //     ,    .
+    bool exactLength = !append && !response.compressed && response.contentEncoding.empty() && response.contentLength > 0;
+    response.sink = OpenDiskFile(response.tempPath, task.taskId, append, exactLength ? response.contentLength : 0);
+    if (append) {
+        response.bytesWritten = task.resumeFrom;
+        response.resumedFrom = task.resumeFrom;
+        response.sinkOffset = task.resumeFrom;
+    }
+    response.journalMark = response.bytesWritten + JournalProgressStep;
+    //         .
+    JournalRecord('S', task.url, response.tempPath + (response.compressed ? "\t0" : "\t1"));
+    if (append) {
+        JournalRecord('P', task.url, to_string(task.resumeFrom));
+    }
+}
+
+//  'P' -        . Ÿ  
+//       :   
+// ,   io_uring     ,    
+// ,        .
+void JournalWrittenBytes(ResponseData& response) {
+    if (!response.sink) {
+        return;
+    }
+    string url = response.task->url;
+    curl_off_t written = response.sinkOffset;
+    NotifyDiskFile(response.sink, [url, written](bool ok) {
+        if (ok) {
+            JournalRecord('P', url, to_string(written));
+        }
+    });
+}
+
+//    PackObjectMax:    
+// ,     .
+void SpillPackedBody(ResponseData& response) {
+    response.packed = false;
+    OpenTempSink(response);
+    curl_off_t offset = 0;
+    for (auto& part : response.packChunks) {
+        WriteDiskFile(response.sink, move(part.first), part.second, offset);
+        offset += static_cast<curl_off_t>(part.second);
+    }
+    response.packChunks.clear();
+}
+
+//   multi,      .
+thread_local vector<CURL*>* pausedTransfers = nullptr;
+
+//     .
+void FlushChunk(ResponseData& response) {
+    if (response.chunkUsed == 0) {
+        return;
+    }
+    if (response.packed) {
+        response.packChunks.emplace_back(move(response.chunk), response.chunkUsed);
+    }
+    else {
+        WriteDiskFile(response.sink, move(response.chunk), response.chunkUsed, response.sinkOffset);
+    }
+    response.sinkOffset += static_cast<curl_off_t>(response.chunkUsed);
+    response.chunkUsed = 0;
+}
+
+//     .  ,    
+//  (    ) -   .
+void TakeChunk(ResponseData& response) {
+    if (response.spareChunks.empty()) {
+        AcquireChunks(response.spareChunks, 1, ChunkWait::Force);
+    }
+    response.chunk = move(response.spareChunks.back());
+    response.spareChunks.pop_back();
+}
+
+//        :   
+// ,  ,     .
+size_t SinkBytesFor(const ResponseData& response, size_t size) {
+#ifdef HAVE_ZSTD
+    if (response.zstd) {
+        return ZSTD_compressBound(size) + ZSTD_CStreamOutSize();
+    }
+#endif
+    return size;
+}
+
+//       ,   .  
+// ,      (   
+// ,    ;       
+//   )     ;   threads  
+// . false -  .
+bool ReserveChunks(ResponseData& response, size_t bytes) {
+    size_t room = (response.chunk ? SinkBufferSize - response.chunkUsed : 0) + response.spareChunks.size() * SinkBufferSize;
+    if (room >= bytes) {
+        return true;
+    }
+    size_t count = (bytes - room + SinkBufferSize - 1) / SinkBufferSize;
+    if (AcquireChunks(response.spareChunks, count, ChunkWait::No)) {
+        return true;
+    }
+    if (response.packed) {
+        SpillPackedBody(response);
+    }
+    FlushChunk(response);
+    response.spareChunks.clear();
+    count = (bytes + SinkBufferSize - 1) / SinkBufferSize;
+    if (!pausedTransfers) {
+        AcquireChunks(response.spareChunks, count, ChunkWait::Yes);
+        return true;
+    }
+    pausedWrites++;
+    response.paused = true;
+    pausedTransfers->push_back(response.curl);
+    return false;
+}
+
+//    ; false -        .
+bool AppendChunk(ResponseData& response, const char* data, size_t size) {
+    if (!response.packed && response.sink->failed) {
+        return false;
+    }
+    while (size > 0) {
+        if (!response.chunk) {
+            TakeChunk(response);
+        }
+        size_t part = min(size, SinkBufferSize - response.chunkUsed);
+        memcpy(response.chunk.get() + response.chunkUsed, data, part);
+        response.chunkUsed += part;
+        data += part;
+        size -= part;
+        if (response.chunkUsed == SinkBufferSize) {
+            FlushChunk(response);
+        }
+    }
+    return true;
+}
+
+#ifdef HAVE_ZSTD
+bool CompressToSink(ResponseData& response, const char* data, size_t size, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer in{ data, size, 0 };
+    size_t left;
+    //       .
+    do {
+        if (!response.chunk) {
+            TakeChunk(response);
+        }
+        ZSTD_outBuffer out{ response.chunk.get() + response.chunkUsed, SinkBufferSize - response.chunkUsed, 0 };
+        left = ZSTD_compressStream2(response.zstd.get(), &out, &in, mode);
+        if (ZSTD_isError(left)) {
+            return false;
+        }
+        response.chunkUsed += out.pos;
+        response.storedBytes += out.pos;
+        if (response.chunkUsed == SinkBufferSize) {
+            FlushChunk(response);
+        }
+    } while (mode == ZSTD_e_end ? left > 0 : in.pos < in.size);
+    return !response.sink->failed;
+}
+#endif
+
+bool WriteSink(ResponseData& response, const char* data, size_t size) {
+#ifdef HAVE_ZSTD
+    if (response.zstd) {
+        return CompressToSink(response, data, size, ZSTD_e_continue);
+    }
+#endif
+    return AppendChunk(response, data, size);
+}
+
+//          .
+bool FlushSink(ResponseData& response) {
+#ifdef HAVE_ZSTD
+    if (response.zstd && !CompressToSink(response, nullptr, 0, ZSTD_e_end)) {
+        return false;
+    }
+#endif
+    FlushChunk(response);
+    return response.packed || !response.sink->failed;
+}
+
+//     :       ,
+//     Content-Disposition .
+bool OpenSink(ResponseData& response) {
+    const DownloadTask& task = *response.task;
+    response.fileName = ResolveFileName(response);
+    if (ShouldCompressAtRest(response) && OpenCompressor(response)) {
+        response.compressed = true;
+        response.fileName += ".zst";
+    }
+
+    bool append = !task.resumePath.empty() && response.responseCode == 206;
+    response.hasher.active = options.dedup && !append && !response.compressed;
+    response.hasher.sha256 = options.dedupSha256;
+    response.journalMark = JournalProgressStep;
+    if (ShouldPack(response)) {
+        response.packed = true;
+        return true;
+    }
+    OpenTempSink(response);
+    return true;
+}
+
+//       .   
+//   .
+void DiscardSink(ResponseData& response) {
+    response.chunkUsed = 0;
+    response.packChunks.clear();
+    if (response.sink && !response.task->segmented) {
+        string tempPath = response.tempPath;
+        CloseDiskFile(response.sink, -1, [tempPath](bool) {
+            error_code ec;
+            filesystem::remove(tempPath, ec);
+        });
+        response.tempPath.clear();
+    }
+    response.sink.reset();
+}
+
+curl_off_t SegmentStart(const SegmentedDownload& download, int segment) {
+    return download.segmentSize * segment;
+}
+
+curl_off_t SegmentEnd(const SegmentedDownload& download, int segment) {
+    return segment == download.segments - 1 ? download.size : download.segmentSize * (segment + 1);
+}
+
+bool IsAcceptedStatus(const DownloadTask& task, long responseCode) {
+    return responseCode == 200 || (responseCode == 206 && !task.resumePath.empty());
+}
+
+bool ShouldSegment(const ResponseData& response) {
+    //  Content-Encoding  -   ,   .
+    return options.segmentThreshold > 0 && options.maxSegments > 1 && response.acceptRanges &&
+        response.contentEncoding.empty() && response.contentLength >= 2 * options.segmentThreshold;
+}
+
+//          .  
+//   :      0.
+bool StartSegmentedDownload(ResponseData& response) {
+    const DownloadTask& task = *response.task;
+
+    auto download = make_shared<SegmentedDownload>();
+    download->url = task.url;
+    download->job = task.job;
+    download->expectedSize = task.expectedSize;
+    download->directoryPath = OutputDirectory(task.job->directoryPath, task.url).string();
+    download->taskId = task.taskId;
+    download->fileName = ResolveFileName(response);
+    download->cachedPath = response.cachedPath;
+    download->etag = response.etag;
+    download->lastModified = response.lastModified;
+    download->size = response.contentLength;
+
+    curl_off_t segments = response.contentLength / options.segmentThreshold;
+    download->segments = static_cast<int>(segments < options.maxSegments ? segments : options.maxSegments);
+    download->segmentSize = download->size / download->segments;
+    download->remaining = download->segments;
+
+    filesystem::path dirpath(download->directoryPath);
+    download->tempPath = (dirpath / ("." + download->fileName + "." + to_string(task.taskId) + ".part")).string();
+    //    ,       .
+    download->file = OpenDiskFile(download->tempPath, task.taskId, false, download->size);
+
+    JournalRecord('S', task.url, download->tempPath + "\t0");
+
+    Log(LogLevel::Info, task.taskId) << "  : " << download->segments << " x " << download->segmentSize << " bytes";
+
+    for (int i = download->segments - 1; i >= 0; --i) {
+        DownloadTask segmentTask;
+        segmentTask.url = task.url;
+        segmentTask.job = task.job;
+        segmentTask.taskId = task.taskId;
+        segmentTask.host = task.host;
+        segmentTask.segmented = download;
+        segmentTask.segment = i;
+        AddQueue(move(segmentTask), true);
+    }
+
+    response.handedOff = true;
+    return true;
+}
+
+//   ,     --probe:  
+//   ,  -  .
+atomic<long long> expectedBytes{ 0 };
+atomic<long long> progressBytes{ 0 };
+chrono::steady_clock::time_point progressStarted;
+
+void CountProgressBytes(ResponseData& response, size_t bytes) {
+    if (response.task->expectedSize >= 0) {
+        progressBytes += static_cast<long long>(bytes);
+        response.progressCounted += static_cast<curl_off_t>(bytes);
+    }
+}
+
+// ", 12.3/456.0 MB (2%),  ~0:01:23"  ,   .
+string ByteProgress() {
+    long long total = expectedBytes;
+    if (total <= 0) {
+        return string();
+    }
+    long long done = min<long long>(progressBytes, total);
+    ostringstream out;
+    out << fixed << setprecision(1) << ", " << done / 1048576.0 << "/" << total / 1048576.0 << " MB (" << done * 100 / total << "%)";
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - progressStarted).count();
+    if (done > 0 && done < total && elapsed >= 1) {
+        long long eta = static_cast<long long>((total - done) / (done / elapsed));
+        out << ",  ~" << eta / 3600 << ":" << setfill('0') << setw(2) << eta / 60 % 60 << ":" << setw(2) << eta % 60;
+    }
+    return out.str();
+}
+
+size_t WriteSegment(ResponseData& response, const char* data, size_t size) {
+    const DownloadTask& task = *response.task;
+    SegmentedDownload& download = *task.segmented;
+
+    //   Range -   .
+    if (response.responseCode != 206 || download.failed) {
+        return 0;
+    }
+
+    curl_off_t offset = SegmentStart(download, task.segment) + response.bytesWritten;
+    if (offset + static_cast<curl_off_t>(size) > SegmentEnd(download, task.segment)) {
+        return 0;
+    }
+    if (!response.sink) {
+        response.sink = download.file;
+        response.sinkOffset = offset;
+    }
+    if (!ReserveChunks(response, size)) {
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    ThrottleBandwidth(size);
+    auto writeStarted = chrono::steady_clock::now();
+    bool written = AppendChunk(response, data, size);
+    response.diskWriteTime += chrono::steady_clock::now() - writeStarted;
+    if (!written) {
+        return 0;
+    }
+    response.bytesWritten += size;
+    CountProgressBytes(response, size);
+    return size;
+}
+
+size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userdata) {
+    if (!userdata || !contents || size == 0 || nmemb == 0) {
+        return 0;
+    }
+
+    ResponseData* response = static_cast<ResponseData*>(userdata);
+    size_t total_size = size * nmemb;
+
+    if (response->task->segmented) {
+        return WriteSegment(*response, static_cast<char*>(contents), total_size);
+    }
+
+    //      ,    .
+    if (!IsAcceptedStatus(*response->task, response->responseCode)) {
+        return total_size;
+    }
+
+    if (!response->sink && !response->packed) {
+        if (ShouldSegment(*response) && StartSegmentedDownload(*response)) {
+            return 0;
+        }
+        if (!OpenSink(*response)) {
+            return 0;
+        }
+    }
+    if (response->packed && response->bytesWritten + static_cast<curl_off_t>(total_size) > PackObjectMax) {
+        SpillPackedBody(*response);
+    }
+    if (!ReserveChunks(*response, SinkBytesFor(*response, total_size))) {
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    ThrottleBandwidth(total_size);
+    auto writeStarted = chrono::steady_clock::now();
+    bool written = WriteSink(*response, static_cast<char*>(contents), total_size);
+    response->diskWriteTime += chrono::steady_clock::now() - writeStarted;
+    if (!written) {
+        return 0;
+    }
+    response->bytesWritten += total_size;
+    CountProgressBytes(*response, total_size);
+    if (response->hasher.active) {
+        response->hasher.Update(contents, total_size);
+    }
+    if (response->bytesWritten >= response->journalMark) {
+        JournalWrittenBytes(*response);
+        response->journalMark = response->bytesWritten + JournalProgressStep;
+    }
+    return total_size;
+}
+
+// HTTP/2. "--http2" - h2  ALPN  https (  h2  
+// HTTP/1.1), "--http2=prior-knowledge" - h2c  TLS. ,   
+// h2c,   HTTP/1.1   ,   
+//   .
+mutex http1HostsMutex;
+unordered_set<string> http1Hosts;
+atomic<int> http2Transfers{ 0 };
+
+bool IsHttp1Host(const string& host) {
+    lock_guard<mutex> lock(http1HostsMutex);
+    return http1Hosts.count(host) > 0;
+}
+
+void SetupHttpVersion(CURL* curl, const DownloadTask& task, ResponseData& response) {
+    if (options.http2.empty()) {
+        return;
+    }
+    if (options.http2 == "prior-knowledge" && !IsHttp1Host(task.host)) {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE));
+        response.priorKnowledge = true;
+    }
+    else if (task.url.compare(0, 8, "https://") == 0) {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+    }
+    else {
+        // HTTP/1.1:  ,   .
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_1_1));
+        return;
+    }
+    //   ,  ,     
+    //  ,     .  
+    // threads       ,  .
+    if (options.engine == "multi") {
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }
+}
+
+// true -    - h2c     .
+bool FallBackToHttp1(CURL* curl, CURLcode res, const DownloadTask& task, ResponseData& response) {
+    if (!response.priorKnowledge || response.responseCode != 0) {
+        return false;
+    }
+    if (res != CURLE_HTTP2 && res != CURLE_HTTP2_STREAM && res != CURLE_RECV_ERROR && res != CURLE_GOT_NOTHING &&
+        res != CURLE_WEIRD_SERVER_REPLY && res != CURLE_UNSUPPORTED_PROTOCOL) {
+        return false;
+    }
+    bool added;
+    {
+        lock_guard<mutex> lock(http1HostsMutex);
+        added = http1Hosts.insert(task.host).second;
+    }
+    if (added) {
+        Log(LogLevel::Warn, task.taskId) << " " << task.host << "   h2c (" << curl_easy_strerror(res)
+            << "),  HTTP/1.1";
+    }
+    AddQueue(task, task.segmented != nullptr);
+    return true;
+}
+
+//  DNS.       , 
+// dnsParallel  ,    ; 
+//    CURLOPT_RESOLVE,  curl    . ,
+//   ,  dnsNegativeTtl :  
+//       . getaddrinfo  
+// TTL ,        - dnsTtl.
+//  --hosts=<>       /etc/hosts.
+struct DnsEntry {
+    //   ,    CURLOPT_RESOLVE;   .
+    string addresses;
+    string error;
+    chrono::steady_clock::time_point expires;
+};
+
+shared_mutex dnsMutex;
+unordered_map<string, DnsEntry> dnsCache;
+unordered_map<string, string> hostsFileEntries;
+atomic<int> dnsResolvedNames{ 0 };
+atomic<int> dnsFailedNames{ 0 };
+atomic<int> dnsFastFailures{ 0 };
+
+void LoadHostsFile(const string& path) {
+    ifstream file(path);
+    if (!file) {
+        throw invalid_argument("--hosts:   : " + path);
+    }
+    string line;
+    while (getline(file, line)) {
+        istringstream fields(line.substr(0, line.find('#')));
+        string address, name;
+        if (!(fields >> address)) {
+            continue;
+        }
+        unsigned char buffer[16];
+        bool v6 = inet_pton(AF_INET6, address.c_str(), buffer) == 1;
+        if (!v6 && inet_pton(AF_INET, address.c_str(), buffer) != 1) {
+            throw invalid_argument("--hosts:  : " + address);
+        }
+        while (fields >> name) {
+            transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+            string& addresses = hostsFileEntries[name];
+            addresses += (addresses.empty() ? "" : ",") + (v6 ? "[" + address + "]" : address);
+        }
+    }
+    options.hostsPath = path;
+}
+
+//     ; false  IP-  ,  http(s).
+bool DnsNameOf(const DownloadTask& task, string& name, string& port) {
+    string host = task.host.empty() ? ExtractHost(task.url) : task.host;
+    if (host.empty() || host[0] == '[') {
+        return false;
+    }
+    size_t colon = host.rfind(':');
+    name = host.substr(0, colon);
+    if (colon != string::npos) {
+        port = host.substr(colon + 1);
+    }
+    else {
+        size_t scheme = task.url.find("://");
+        string prefix = scheme == string::npos ? "http" : task.url.substr(0, scheme);
+        transform(prefix.begin(), prefix.end(), prefix.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+        if (prefix == "https") {
+            port = "443";
+        }
+        else if (prefix == "http") {
+            port = "80";
+        }
+        else {
+            return false;
+        }
+    }
+    unsigned char buffer[16];
+    return !name.empty() && !port.empty() && inet_pton(AF_INET, name.c_str(), buffer) != 1;
+}
+
+DnsEntry ResolveName(const string& name) {
+    DnsEntry entry;
+    if (!options.hostsPath.empty()) {
+        auto it = hostsFileEntries.find(name);
+        if (it != hostsFileEntries.end()) {
+            entry.addresses = it->second;
+        }
+        else {
+            entry.error = "  " + options.hostsPath;
+        }
+        return entry;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    int status = getaddrinfo(name.c_str(), nullptr, &hints, &result);
+    if (status != 0) {
+        entry.error = gai_strerror(status);
+        return entry;
+    }
+    unordered_set<string> seen;
+    for (addrinfo* info = result; info; info = info->ai_next) {
+        char text[INET6_ADDRSTRLEN] = {};
+        string address;
+        if (info->ai_family == AF_INET) {
+            inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(info->ai_addr)->sin_addr, text, sizeof(text));
+            address = text;
+        }
+        else if (info->ai_family == AF_INET6) {
+            inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(info->ai_addr)->sin6_addr, text, sizeof(text));
+            address = "[" + string(text) + "]";
+        }
+        if (!address.empty() && seen.insert(address).second) {
+            entry.addresses += (entry.addresses.empty() ? "" : ",") + address;
+        }
+    }
+    freeaddrinfo(result);
+    if (entry.addresses.empty()) {
+        entry.error = " ";
+    }
+    return entry;
+}
+
+void StoreDnsEntry(const string& name, DnsEntry entry) {
+    bool failed = !entry.error.empty();
+    entry.expires = chrono::steady_clock::now() + chrono::seconds(failed ? options.dnsNegativeTtl : options.dnsTtl);
+    (failed ? dnsFailedNames : dnsResolvedNames)++;
+    unique_lock<shared_mutex> lock(dnsMutex);
+    dnsCache[name] = move(entry);
+}
+
+//           .
+void PreResolveHosts(const vector<DownloadTask>& tasks) {
+    if (options.dnsParallel == 0) {
+        return;
+    }
+    vector<string> names;
+    {
+        unordered_set<string> seen;
+        auto now = chrono::steady_clock::now();
+        shared_lock<shared_mutex> lock(dnsMutex);
+        for (const DownloadTask& task : tasks) {
+            string name, port;
+            if (!DnsNameOf(task, name, port) || !seen.insert(name).second) {
+                continue;
+            }
+            auto it = dnsCache.find(name);
+            if (it == dnsCache.end() || it->second.expires <= now) {
+                names.push_back(move(name));
+            }
+        }
+    }
+    if (names.empty()) {
+        return;
+    }
+
+    auto started = chrono::steady_clock::now();
+    int failedBefore = dnsFailedNames;
+    atomic<size_t> next{ 0 };
+    vector<thread> resolvers;
+    size_t count = min(names.size(), static_cast<size_t>(options.dnsParallel));
+    for (size_t i = 0; i < count; ++i) {
+        resolvers.emplace_back([&]() {
+            for (size_t index = next++; index < names.size(); index = next++) {
+                StoreDnsEntry(names[index], ResolveName(names[index]));
+            }
+        });
+    }
+    for (auto& resolver : resolvers) {
+        resolver.join();
+    }
+    Log(LogLevel::Info) << "[DNS] " << names.size() << "   "
+        << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count()
+        << " ,  : " << dnsFailedNames - failedBefore;
+}
+
+//    . false -    ,   .
+//        curl,   --hosts:   .
+bool ApplyDnsCache(CURL* curl, const DownloadTask& task, ResponseData& response) {
+    string name, port;
+    if (options.dnsParallel == 0 || !DnsNameOf(task, name, port)) {
+        return true;
+    }
+    DnsEntry entry;
+    {
+        shared_lock<shared_mutex> lock(dnsMutex);
+        auto it = dnsCache.find(name);
+        if (it != dnsCache.end() && it->second.expires > chrono::steady_clock::now()) {
+            entry = it->second;
+        }
+    }
+    if (entry.addresses.empty() && entry.error.empty()) {
+        if (options.hostsPath.empty()) {
+            return true;
+        }
+        entry = ResolveName(name);
+        StoreDnsEntry(name, entry);
+    }
+    if (!entry.error.empty()) {
+        return false;
+    }
+    // "+" -     curl   ,    .
+#if LIBCURL_VERSION_NUM >= 0x074B00
+    string resolve = "+" + name + ":" + port + ":" + entry.addresses;
+#else
+    string resolve = name + ":" + port + ":" + entry.addresses;
+#endif
+    response.resolveList.reset(curl_slist_append(nullptr, resolve.c_str()));
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, response.resolveList.get());
+    return true;
+}
+
+// ,     curl,     .
+void RememberUnresolved(const DownloadTask& task, CURLcode res) {
+    string name, port;
+    if (res != CURLE_COULDNT_RESOLVE_HOST || options.dnsParallel == 0 || !DnsNameOf(task, name, port)) {
+        return;
+    }
+    DnsEntry entry;
+    entry.error = curl_easy_strerror(res);
+    StoreDnsEntry(name, move(entry));
+}
+
+//      :      .
+bool InJobDirectory(const DownloadJob& job, const string& url, const string& path) {
+    filesystem::path file(path);
+    return (OutputDirectory(job.directoryPath, url) / file.filename()).lexically_normal() == file.lexically_normal();
+}
+
+// false -     DNS,    .
+bool SetupTransfer(CURL* curl, const DownloadTask& task, ResponseData& response) {
+    response.task = &task;
+    response.curl = curl;
+    if (!ApplyDnsCache(curl, task, response)) {
+        return false;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, task.url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36");
+    if (task.segmented) {
+        //     ,    .
+        string range = to_string(SegmentStart(*task.segmented, task.segment)) + "-" +
+            to_string(SegmentEnd(*task.segmented, task.segment) - 1);
+        curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+    }
+    else {
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
+    }
+    //       :   
+    //   ,       .
+    if (options.acceptEncoding && !task.segmented && task.resumeFrom == 0) {
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    }
+    if (task.resumeFrom > 0) {
+        curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, task.resumeFrom);
+    }
+    else if (!task.segmented && manifest.file) {
+        ManifestEntry entry;
+        error_code ec;
+        if (FindManifestEntry(task.url, entry) && InJobDirectory(*task.job, task.url, entry.path) &&
+            filesystem::file_size(entry.path, ec) == static_cast<uintmax_t>(entry.size) && !ec) {
+            curl_slist* headers = nullptr;
+            if (!entry.etag.empty()) {
+                headers = curl_slist_append(headers, ("If-None-Match: " + entry.etag).c_str());
+            }
+            if (!entry.lastModified.empty()) {
+                headers = curl_slist_append(headers, ("If-Modified-Since: " + entry.lastModified).c_str());
+            }
+            response.requestHeaders.reset(headers);
+            response.cachedPath = entry.path;
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        }
+    }
+
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    if (curlShare) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, curlShare);
+    }
+    SetupHttpVersion(curl, task, response);
+    return true;
+}
+
+// CURLINFO_NUM_CONNECTS == 0 ,       .
+void CountConnectionReuse(CURL* curl, CURLcode res) {
+    if (res == CURLE_COULDNT_RESOLVE_HOST || res == CURLE_COULDNT_CONNECT) {
+        return;
+    }
+    long connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    connectedTransfers++;
+    if (connects == 0) {
+        reusedConnections++;
+    }
+    long version = 0;
+    curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+    if (version == CURL_HTTP_VERSION_2_0) {
+        http2Transfers++;
+    }
+}
+
+// .  , , 429  5xx    :
+//         ,   
+//   .  - RetryWheelSlots   RetryTickMs,
+//           .
+const int RetryWheelSlots = 512;
+const int RetryTickMs = 100;
+const int RetryAfterMaxMs = 10 * 60 * 1000;
+
+struct RetryEntry {
+    uint64_t due;
+    DownloadTask task;
+};
+
+struct RetryWheel {
+    mutex wheelMutex;
+    condition_variable wheelCondition;
+    vector<vector<RetryEntry>> slots;
+    uint64_t tick = 0;
+    size_t pending = 0;
+    bool running = false;
+    thread timer;
+};
+
+RetryWheel retryWheel;
+atomic<int> retriedTasks{ 0 };
+
+//     ( Content-Encoding)   .
+atomic<long long> transferWireBytes{ 0 };
+atomic<long long> transferLogicalBytes{ 0 };
+
+const char* RetryClassNames[] = { "net", "timeout", "429", "5xx" };
+
+bool ClassifyFailure(CURLcode res, long responseCode, RetryClass& retryClass) {
+    switch (res) {
+    case CURLE_OK:
+        break;
+    case CURLE_OPERATION_TIMEDOUT:
+        retryClass = RetryClass::Timeout;
+        return true;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+    case CURLE_SSL_CONNECT_ERROR:
+        retryClass = RetryClass::Network;
+        return true;
+    default:
+        return false;
+    }
+    if (responseCode == 408) {
+        retryClass = RetryClass::Timeout;
+        return true;
+    }
+    if (responseCode == 429) {
+        retryClass = RetryClass::Throttled;
+        return true;
+    }
+    if (responseCode == 500 || responseCode == 502 || responseCode == 503 || responseCode == 504) {
+        retryClass = RetryClass::Server;
+        return true;
+    }
+    return false;
+}
+
+// Retry-After:    HTTP-; -1,       .
+long long ParseRetryAfter(const string& value) {
+    if (value.empty()) {
+        return -1;
+    }
+    const long long maxSeconds = RetryAfterMaxMs / 1000LL;
+    if (isdigit(static_cast<unsigned char>(value[0]))) {
+        //    :    
+        //      .
+        char* end = nullptr;
+        errno = 0;
+        long long seconds = strtoll(value.c_str(), &end, 10);
+        while (*end == ' ' || *end == '\t' || *end == '\r') {
+            ++end;
+        }
+        if (*end != '\0' || (errno == ERANGE && seconds != LLONG_MAX)) {
+            return -1;
+        }
+        return min(seconds, maxSeconds) * 1000;
+    }
+    time_t when = curl_getdate(value.c_str(), nullptr);
+    if (when < 0) {
+        return -1;
+    }
+    long long seconds = static_cast<long long>(when) - static_cast<long long>(time(nullptr));
+    return min(max(seconds, 0LL), maxSeconds) * 1000;
+}
+
+// base * 2^,     (equal jitter),   retryMaxMs.
+// Retry-After    .
+long long RetryDelayMs(const RetryPolicy& policy, int attempt, long long retryAfterMs) {
+    thread_local mt19937 jitter{ random_device{}() };
+    long long backoff = min<long long>(static_cast<long long>(policy.baseMs) << min(attempt, 20), options.retryMaxMs);
+    long long delay = backoff / 2 + uniform_int_distribution<long long>(0, backoff / 2)(jitter);
+    return max(delay, retryAfterMs);
+}
+
+void RetryTimerLoop() {
+    auto started = chrono::steady_clock::now();
+    vector<DownloadTask> ready;
+    unique_lock<mutex> lock(retryWheel.wheelMutex);
+    while (retryWheel.running) {
+        auto next = started + chrono::milliseconds(static_cast<long long>(retryWheel.tick + 1) * RetryTickMs);
+        if (retryWheel.wheelCondition.wait_until(lock, next) != cv_status::timeout) {
+            continue;
+        }
+        uint64_t tick = ++retryWheel.tick;
+        vector<RetryEntry>& slot = retryWheel.slots[tick % RetryWheelSlots];
+        for (size_t i = 0; i < slot.size();) {
+            if (slot[i].due <= tick) {
+                ready.push_back(move(slot[i].task));
+                slot[i] = move(slot.back());
+                slot.pop_back();
+            }
+            else {
+                ++i;
+            }
+        }
+        if (ready.empty()) {
+            continue;
+        }
+        retryWheel.pending -= ready.size();
+        lock.unlock();
+        for (DownloadTask& task : ready) {
+            bool urgent = task.segmented != nullptr;
+            AddQueue(move(task), urgent);
+        }
+        ready.clear();
+        lock.lock();
+    }
+}
+
+void StartRetryWheel() {
+    lock_guard<mutex> lock(retryWheel.wheelMutex);
+    retryWheel.slots.assign(RetryWheelSlots, vector<RetryEntry>());
+    retryWheel.tick = 0;
+    retryWheel.pending = 0;
+    retryWheel.running = true;
+    retryWheel.timer = thread(RetryTimerLoop);
+}
+
+//   :     .
+void StopRetryWheel() {
+    size_t dropped = 0;
+    {
+        lock_guard<mutex> lock(retryWheel.wheelMutex);
+        if (!retryWheel.running) {
+            return;
+        }
+        retryWheel.running = false;
+        dropped = retryWheel.pending;
+    }
+    retryWheel.wheelCondition.notify_one();
+    retryWheel.timer.join();
+    if (dropped > 0) {
+        Log(LogLevel::Warn) << "[]   : " << static_cast<long long>(dropped);
+    }
+}
+
+//    ,         .
+bool ScheduleRetry(const DownloadTask& task, CURLcode res, long responseCode, long long retryAfterMs,
+    const string& resumePath = string(), curl_off_t resumeFrom = 0) {
+    RetryClass retryClass;
+    if (!ClassifyFailure(res, responseCode, retryClass)) {
+        return false;
+    }
+    const RetryPolicy& policy = options.retry[static_cast<int>(retryClass)];
+    if (task.attempt >= policy.attempts || stopThreads) {
+        return false;
+    }
+
+    long long delay = RetryDelayMs(policy, task.attempt, retryAfterMs);
+    DownloadTask retry = task;
+    retry.attempt++;
+    retry.resumePath = resumePath;
+    retry.resumeFrom = resumeFrom;
+    {
+        lock_guard<mutex> lock(retryWheel.wheelMutex);
+        if (!retryWheel.running) {
+            return false;
+        }
+        uint64_t due = retryWheel.tick + max<uint64_t>(1, (delay + RetryTickMs - 1) / RetryTickMs);
+        retryWheel.slots[due % RetryWheelSlots].push_back(RetryEntry{ due, move(retry) });
+        retryWheel.pending++;
+    }
+    retriedTasks++;
+    Log(LogLevel::Warn, task.taskId) << "  " << delay << "  (" << RetryClassNames[static_cast<int>(retryClass)]
+        << ",  " << task.attempt + 1 << "/" << policy.attempts << ")"
+        << (resumeFrom > 0 ? ",   " + to_string(resumeFrom) : string());
+    return true;
+}
+
+void ReportTaskResult(const DownloadJob& job, const string& url, curl_off_t expectedSize, bool success,
+    const string& fullPath = string()) {
+    if (expectedSize > 0) {
+        progressBytes += expectedSize;
+    }
+    if (success) {
+        completedTasks++;
+        JournalRecord('D', url, fullPath);
+    }
+    else {
+        failedTasks++;
+        JournalRecord('F', url);
+    }
+    FileIndexRecord(url, fullPath, success);
+    if (job.progress) {
+        (success ? job.progress->completed : job.progress->failed)++;
+        job.progress->latch.CountDown();
+    }
+    tasksLatch.CountDown();
+    int processed = completedTasks + failedTasks;
+    if (processed % 10 == 0 || processed == totalTasks) {
+        int total = totalTasks;
+        Log(LogLevel::Info) << "[] " << processed << "/" << total << "(" << (total > 0 ? (processed * 100 / total) : 0) << "%)"
+            << ByteProgress();
+    }
+}
+
+//     ;   
+// ,      .
+void FinishSegment(const shared_ptr<SegmentedDownload>& download, bool success) {
+    if (!success) {
+        download->failed = true;
+    }
+    if (--download->remaining > 0) {
+        return;
+    }
+
+    CloseDiskFile(download->file, download->size, [download](bool written) {
+        bool ok = written && !download->failed;
+        string fullPath;
+        if (ok) {
+            ContentHasher hasher;
+            error_code ec;
+            fullPath = PlaceDownloadedFile(download->tempPath, filesystem::path(download->directoryPath), download->fileName,
+                download->cachedPath, download->size, hasher, ec);
+            if (ec) {
+                Log(LogLevel::Error, download->taskId) << "    " << fullPath << ": " << ec.message();
+                ok = false;
+            }
+            else {
+                Log(LogLevel::Info, download->taskId) << " : " << fullPath
+                    << " (" << download->size << " bytes, " << download->segments << " )";
+                ManifestRecord(download->url, ManifestEntry{ download->etag, download->lastModified, fullPath, download->size });
+            }
+        }
+        if (!ok) {
+            error_code ec;
+            filesystem::remove(download->tempPath, ec);
+        }
+        ReportTaskResult(*download->job, download->url, download->expectedSize, ok, fullPath);
+    });
+}
+
+//  ,        .
+struct FinishedFile {
+    string tempPath;
+    string fileName;
+    string cachedPath;
+    string etag;
+    string lastModified;
+    curl_off_t size = 0;
+    bool compressed = false;
+    curl_off_t storedBytes = 0;
+    ContentHasher hasher;
+};
+
+//   ,       .
+void PlaceFinishedFile(const DownloadTask& task, FinishedFile& file, bool written) {
+    int taskId = task.taskId;
+    error_code ec;
+    if (!written) {
+        Log(LogLevel::Error, taskId) << " : " << file.tempPath;
+        filesystem::remove(file.tempPath, ec);
+        ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+        return;
+    }
+
+    string fullPath = PlaceDownloadedFile(file.tempPath, OutputDirectory(task.job->directoryPath, task.url), file.fileName,
+        file.cachedPath, file.size, file.hasher, ec);
+    if (ec) {
+        Log(LogLevel::Error, taskId) << "    " << fullPath << ": " << ec.message();
+        filesystem::remove(file.tempPath, ec);
+        ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+        return;
+    }
+
+    //       :   ,   .
+    curl_off_t storedSize = file.size;
+    if (file.compressed) {
+        storedSize = file.storedBytes;
+        RecordStoredSize(fullPath, file.size, storedSize);
+    }
+    Log(LogLevel::Info, taskId) << " : " << fullPath << " (" << file.size << " bytes"
+        << (file.compressed ? ",   " + to_string(storedSize) : string()) << ")";
+    ManifestRecord(task.url, ManifestEntry{ file.etag, file.lastModified, fullPath, storedSize });
+    ReportTaskResult(*task.job, task.url, task.expectedSize, true, fullPath);
+}
+
+//     .
+struct PackSegment {
+    shared_ptr<DiskFile> file;
+    int number = 0;
+    curl_off_t size = 0;
+};
+
+//      ;     .
+struct PackWriter {
+    unordered_map<string, PackSegment> segments;
+};
+
+//   :     .
+struct PackDirectory {
+    FILE* index = nullptr;
+    int nextSegment = 1;
+};
+
+struct PackStore {
+    mutex storeMutex;
+    vector<unique_ptr<PackWriter>> writers;
+    unordered_map<string, PackDirectory> directories;
+};
+
+PackStore packStore;
+thread_local PackWriter* packWriter = nullptr;
+atomic<int> packedFiles{ 0 };
+atomic<long long> packedBytes{ 0 };
+atomic<int> packSegments{ 0 };
+
+string PackSegmentPath(const string& directoryPath, int number) {
+    char name[32];
+    snprintf(name, sizeof(name), "pack-%06d.pack", number);
+    return (filesystem::path(directoryPath) / name).string();
+}
+
+//  storeMutex.      .
+PackDirectory& OpenPackDirectory(const string& directoryPath) {
+    auto found = packStore.directories.find(directoryPath);
+    if (found != packStore.directories.end()) {
+        return found->second;
+    }
+    PackDirectory& directory = packStore.directories[directoryPath];
+    error_code ec;
+    for (filesystem::directory_iterator it(directoryPath, ec), end; !ec && it != end; it.increment(ec)) {
+        int number = 0;
+        if (sscanf(it->path().filename().string().c_str(), "pack-%d.pack", &number) == 1) {
+            directory.nextSegment = max(directory.nextSegment, number + 1);
+        }
+    }
+    string indexPath = SiblingPath(directoryPath, ".packs");
+    directory.index = OpenRecordFile(indexPath, PackIndexFormat, " ");
+    return directory;
+}
+
+// ,    ;     .
+PackSegment& CurrentPackSegment(const string& directoryPath, curl_off_t recordSize) {
+    if (!packWriter) {
+        lock_guard<mutex> lock(packStore.storeMutex);
+        packStore.writers.emplace_back(new PackWriter());
+        packWriter = packStore.writers.back().get();
+    }
+    PackSegment& segment = packWriter->segments[directoryPath];
+    if (segment.file && !segment.file->failed &&
+        (segment.size == RecordHeaderSize || segment.size + recordSize <= options.packSegmentSize)) {
+        return segment;
+    }
+    if (segment.file) {
+        CloseDiskFile(segment.file, -1, nullptr);
+    }
+    {
+        lock_guard<mutex> lock(packStore.storeMutex);
+        segment.number = OpenPackDirectory(directoryPath).nextSegment++;
+    }
+    segment.file = OpenDiskFile(PackSegmentPath(directoryPath, segment.number), 0, false, 0);
+    vector<PooledChunk> header;
+    AcquireChunks(header, 1, ChunkWait::Force);
+    memcpy(header.front().get(), PackMagic, 4);
+    memcpy(header.front().get() + 4, &PackVersion, 4);
+    WriteDiskFile(segment.file, move(header.front()), RecordHeaderSize, 0);
+    segment.size = RecordHeaderSize;
+    packSegments++;
+    return segment;
+}
+
+bool PackIndexRecord(const string& directoryPath, const string& url, int number, curl_off_t offset, curl_off_t size,
+    const string& fileName) {
+    uint32_t length = static_cast<uint32_t>(PackIndexFormat.fixedSize + url.size() + fileName.size());
+    uint32_t segment = static_cast<uint32_t>(number);
+    int64_t values[2] = { offset, size };
+    uint16_t lengths[2] = { static_cast<uint16_t>(url.size()), static_cast<uint16_t>(fileName.size()) };
+    string record;
+    record.reserve(length);
+    record.append(reinterpret_cast<const char*>(&length), 4);
+    record.append(reinterpret_cast<const char*>(&segment), 4);
+    record.append(reinterpret_cast<const char*>(values), 16);
+    record.append(reinterpret_cast<const char*>(lengths), 4);
+    record += url;
+    record += fileName;
+    lock_guard<mutex> lock(packStore.storeMutex);
+    FILE* index = packStore.directories[directoryPath].index;
+    return index && fwrite(record.data(), 1, record.size(), index) == record.size();
+}
+
+//        ;  
+// ,       .
+void AppendToPack(const DownloadTask& task, ResponseData& response) {
+    const string& directoryPath = task.job->directoryPath;
+    curl_off_t size = response.bytesWritten;
+    size_t headerSize = PackRecordFixedSize + task.url.size() + response.fileName.size();
+    PackSegment& segment = CurrentPackSegment(directoryPath, static_cast<curl_off_t>(headerSize) + size);
+
+    vector<PooledChunk> header;
+    AcquireChunks(header, 1, ChunkWait::Force);
+    char* out = header.front().get();
+    uint32_t length = static_cast<uint32_t>(headerSize);
+    int64_t bodySize = size;
+    uint16_t lengths[2] = { static_cast<uint16_t>(task.url.size()), static_cast<uint16_t>(response.fileName.size()) };
+    memcpy(out, &length, 4);
+    memcpy(out + 4, &bodySize, 8);
+    memcpy(out + 12, lengths, 4);
+    memcpy(out + PackRecordFixedSize, task.url.data(), task.url.size());
+    memcpy(out + PackRecordFixedSize + task.url.size(), response.fileName.data(), response.fileName.size());
+    WriteDiskFile(segment.file, move(header.front()), headerSize, segment.size);
+    segment.size += static_cast<curl_off_t>(headerSize);
+
+    curl_off_t offset = segment.size;
+    for (auto& part : response.packChunks) {
+        WriteDiskFile(segment.file, move(part.first), part.second, segment.size);
+        segment.size += static_cast<curl_off_t>(part.second);
+    }
+    response.packChunks.clear();
+
+    int number = segment.number;
+    string fileName = response.fileName;
+    NotifyDiskFile(segment.file, [task, number, offset, size, fileName](bool written) {
+        string segmentPath = PackSegmentPath(task.job->directoryPath, number);
+        if (!written || !PackIndexRecord(task.job->directoryPath, task.url, number, offset, size, fileName)) {
+            Log(LogLevel::Error, task.taskId) << "   : " << segmentPath;
+            ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+            return;
+        }
+        packedFiles++;
+        packedBytes += size;
+        Log(LogLevel::Info, task.taskId) << " : " << segmentPath << " @" << offset << " (" << size << " bytes)";
+        ReportTaskResult(*task.job, task.url, task.expectedSize, true, segmentPath);
+    });
+}
+
+//      ,    .
+void ClosePackSegments() {
+    lock_guard<mutex> lock(packStore.storeMutex);
+    for (auto& writer : packStore.writers) {
+        for (auto& segment : writer->segments) {
+            CloseDiskFile(segment.second.file, -1, nullptr);
+        }
+    }
+    packStore.writers.clear();
+}
+
+//  -   :       .
+void ClosePackIndexes() {
+    lock_guard<mutex> lock(packStore.storeMutex);
+    for (auto& directory : packStore.directories) {
+        if (directory.second.index) {
+            fclose(directory.second.index);
+        }
+    }
+    packStore.directories.clear();
+}
+
+// --extract=<dir>:   URL      
+//  "<dir>"   --extract-to (  ) 
+//     "url<TAB>"; URL,   
+// ,   "-".
+int RunExtract() {
+    string indexPath = SiblingPath(options.extractDirectory, ".packs");
+    MappedFile index;
+    vector<pair<uint64_t, size_t>> byUrl;
+    if (!index.Open(indexPath, false) || !IndexRecordsByUrl(index, PackIndexFormat, byUrl)) {
+        cerr << ":      " << indexPath << endl;
+        return 1;
+    }
+    filesystem::path target(options.extractTarget);
+    error_code ec;
+    filesystem::create_directories(target, ec);
+
+    MappedFile segment;
+    uint32_t openSegment = 0;
+    string url;
+    while (ReadUrlLine(url)) {
+        const char* record = FindLastRecord(index, PackIndexFormat, byUrl, url);
+        if (!record) {
+            cout << url << "\t-\n";
+            continue;
+        }
+        uint32_t number;
+        int64_t offset, size;
+        memcpy(&number, record + 4, 4);
+        memcpy(&offset, record + 8, 8);
+        memcpy(&size, record + 16, 8);
+        if (number != openSegment) {
+            openSegment = segment.Open(PackSegmentPath(options.extractDirectory, static_cast<int>(number)), false) ? number : 0;
+        }
+        if (openSegment == 0 || offset < 0 || size < 0 || static_cast<uint64_t>(offset + size) > segment.size) {
+            cerr << ":      " << url << endl;
+            cout << url << "\t-\n";
+            continue;
+        }
+        string fileName(record + PackIndexFormat.fixedSize + RecordField(PackIndexFormat, record, 0),
+            RecordField(PackIndexFormat, record, 1));
+        string path = ReserveFileName(target, fileName);
+        ofstream out(path, ios::binary);
+        out.write(segment.data + offset, size);
+        if (!out.flush()) {
+            cerr << " : " << path << endl;
+            return 1;
+        }
+        cout << url << "\t" << path << "\n";
+    }
+    cout.flush();
+    return 0;
+}
+
+//      (416   206):  
+// ,     .
+bool RestartResume(const DownloadTask& task) {
+    if (task.resumePath.empty()) {
+        return false;
+    }
+    error_code ec;
+    filesystem::remove(task.resumePath, ec);
+    Log(LogLevel::Warn, task.taskId) << "  " << task.resumeFrom << "  ,  ";
+    DownloadTask restart = task;
+    restart.resumePath.clear();
+    restart.resumeFrom = 0;
+    AddQueue(move(restart), false);
+    return true;
+}
+
+//        ;     .
+void FinishTransfer(CURL* curl, CURLcode res, const DownloadTask& task, ResponseData& response) {
+    CountConnectionReuse(curl, res);
+    RememberUnresolved(task, res);
+    //   :   ,   .
+    progressBytes -= response.progressCounted;
+    ReleaseHost(task, response.bytesWritten - response.resumedFrom);
+
+    long responseCode = 0;
+    curl_off_t wireBytes = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &responseCode);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wireBytes);
+    transferWireBytes += wireBytes;
+    transferLogicalBytes += response.bytesWritten - response.resumedFrom;
+    RecordTransferMetrics(curl, task, response.handedOff || (res == CURLE_OK && responseCode < 400),
+        response.bytesWritten - response.resumedFrom,
+        chrono::duration_cast<chrono::microseconds>(response.diskWriteTime).count());
+    RecordControlSample(curl, responseCode);
+
+    int taskId = task.taskId;
+    if (res != CURLE_OK && FallBackToHttp1(curl, res, task, response)) {
+        DiscardSink(response);
+        return;
+    }
+    if (task.segmented) {
+        curl_off_t expected = SegmentEnd(*task.segmented, task.segment) - SegmentStart(*task.segmented, task.segment);
+        bool ok = res == CURLE_OK && response.bytesWritten == expected;
+        if (!ok) {
+            Log(LogLevel::Error, taskId) << "  " << task.segment << ": "
+                << (res != CURLE_OK ? curl_easy_strerror(res) : " ");
+            //   206   WriteSegment,     .
+            CURLcode failure = res == CURLE_OK ? CURLE_PARTIAL_FILE : res;
+            if (res == CURLE_WRITE_ERROR && responseCode != 206) {
+                failure = CURLE_OK;
+            }
+            if (!task.segmented->failed && !task.segmented->file->failed && ScheduleRetry(task, failure, responseCode, ParseRetryAfter(response.retryAfter))) {
+                return;
+            }
+        }
+        if (ok) {
+            FlushChunk(response);
+        }
+        FinishSegment(task.segmented, ok);
+        return;
+    }
+    if (response.handedOff) {
+        return;
+    }
+
+    if (res != CURLE_OK) {
+        Log(LogLevel::Error, taskId) << " : " << curl_easy_strerror(res);
+        //    Accept-Ranges     ,
+        //    .
+        //    ,      .
+        if (response.sink && response.acceptRanges && response.bytesWritten > 0 && response.cachedPath.empty() &&
+            !response.compressed) {
+            FlushChunk(response);
+            string tempPath = response.tempPath;
+            curl_off_t written = response.sinkOffset;
+            CloseDiskFile(response.sink, written, [task, res, responseCode, tempPath, written](bool ok) {
+                if (ok && ScheduleRetry(task, res, responseCode, -1, tempPath, written)) {
+                    return;
+                }
+                error_code ec;
+                filesystem::remove(tempPath, ec);
+                if (!ScheduleRetry(task, res, responseCode, -1)) {
+                    ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+                }
+            });
+            response.sink.reset();
+            response.tempPath.clear();
+            return;
+        }
+        else if (response.tempPath.empty() && ScheduleRetry(task, res, responseCode, -1, task.resumePath, task.resumeFrom)) {
+            return;
+        }
+        DiscardSink(response);
+        if (!ScheduleRetry(task, res, responseCode, -1)) {
+            ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+        }
+        return;
+    }
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.responseCode);
+
+    if (response.responseCode == 304 && !response.cachedPath.empty()) {
+        notModifiedTasks++;
+        Log(LogLevel::Info, taskId) << " : " << response.cachedPath;
+        ReportTaskResult(*task.job, task.url, task.expectedSize, true, response.cachedPath);
+        return;
+    }
+
+    if (!IsAcceptedStatus(task, response.responseCode)) {
+        Log(LogLevel::Error, taskId) << " HTTP  " << response.responseCode;
+        DiscardSink(response);
+        if (response.responseCode == 416 && RestartResume(task)) {
+            return;
+        }
+        if (!ScheduleRetry(task, res, response.responseCode, ParseRetryAfter(response.retryAfter), task.resumePath, task.resumeFrom)) {
+            ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+        }
+        return;
+    }
+    if (response.bytesWritten == 0) {
+        Log(LogLevel::Error, taskId) << "Empty response content";
+        DiscardSink(response);
+        if (RestartResume(task)) {
+            return;
+        }
+        ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+        return;
+    }
+
+    if (!FlushSink(response)) {
+        Log(LogLevel::Error, taskId) << " : " << response.tempPath;
+        DiscardSink(response);
+        ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+        return;
+    }
+    if (response.packed) {
+        AppendToPack(task, response);
+        return;
+    }
+
+    FinishedFile finished{ response.tempPath, response.fileName, response.cachedPath, response.etag, response.lastModified,
+        response.bytesWritten, response.compressed, response.storedBytes, response.hasher };
+    CloseDiskFile(response.sink, response.sinkOffset, [task, finished](bool written) mutable {
+        PlaceFinishedFile(task, finished, written);
+    });
+    response.sink.reset();
+    response.tempPath.clear();
+}
+
+//      DNS:      .
+void FailUnresolved(const DownloadTask& task) {
+    dnsFastFailures++;
+    ReleaseHost(task, 0);
+    Log(LogLevel::Error, task.taskId) << " :     ( DNS): " << task.host;
+    if (task.segmented) {
+        FinishSegment(task.segmented, false);
+        return;
+    }
+    ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+}
+
+// curl -   ,    :
+// curl_easy_reset     .
+void DowloadFunc(CURL* curl, const DownloadTask& task) {
+        curl_easy_reset(curl);
+
+        ResponseData response;
+        CURLcode res;
+
+        if (!SetupTransfer(curl, task, response)) {
+            FailUnresolved(task);
+            return;
+        }
+
+        Log(LogLevel::Info, task.taskId) << " : " << task.url
+            << (task.segmented ? " ( " + to_string(task.segment + 1) + ")" : "");
+        res = curl_easy_perform(curl);
+
+        FinishTransfer(curl, res, task, response);
+    }
+
+struct CurlGuard {
+    CURL* curl;
+    CurlGuard(CURL* c) : curl(c) {}
+    ~CurlGuard() { if (curl) curl_easy_cleanup(curl); }
+};
+
+void WorkerThread(int index) {
+    workerIndex = index;
+    activeThreads++;
+
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+        Log(LogLevel::Error) << " ";
+        activeThreads--;
+        return;
+    }
+    CurlGuard curl_guard(curl);
+
+    DownloadTask task;
+    while (AcquireTransferSlot(true)) {
+        if (!PopTask(task)) {
+            ReleaseTransferSlot();
+            break;
+        }
+        DowloadFunc(curl, task);
+        ReleaseTransferSlot();
+    }
+    activeThreads--;
+   
+}
+
+//  :  CURLM  ,    epoll
+// (   - curl_multi_poll),    maxInFlight .
+struct MultiLoop {
+    CURLM* multi = nullptr;
+    int running = 0;
+    vector<CURL*> idleHandles;
+    vector<CURL*> paused;
+#ifdef __linux__
+    int epfd = -1;
+    bool timerSet = false;
+    chrono::steady_clock::time_point deadline;
+#endif
+};
+
+#ifdef __linux__
+int MultiSocketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp) {
+    MultiLoop* loop = static_cast<MultiLoop*>(userp);
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, nullptr);
+        curl_multi_assign(loop->multi, s, nullptr);
+        return 0;
+    }
+
+    epoll_event ev{};
+    ev.events = ((what & CURL_POLL_IN) ? uint32_t(EPOLLIN) : 0u) | ((what & CURL_POLL_OUT) ? uint32_t(EPOLLOUT) : 0u);
+    ev.data.fd = s;
+
+    if (socketp) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev);
+    }
+    else {
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev) != 0 && errno == EEXIST) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev);
+        }
+        curl_multi_assign(loop->multi, s, loop);
+    }
+    return 0;
+}
+
+int MultiTimerCallback(CURLM* multi, long timeout_ms, void* userp) {
+    MultiLoop* loop = static_cast<MultiLoop*>(userp);
+
+    if (timeout_ms < 0) {
+        loop->timerSet = false;
+    }
+    else {
+        loop->timerSet = true;
+        loop->deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    }
+    return 0;
+}
+#endif
+
+void StartMultiTransfer(MultiLoop& loop, DownloadTask task) {
+    CURL* curl;
+    if (!loop.idleHandles.empty()) {
+        curl = loop.idleHandles.back();
+        loop.idleHandles.pop_back();
+        curl_easy_reset(curl);
+    }
+    else {
+        curl = curl_easy_init();
+    }
+    if (!curl) {
+        Log(LogLevel::Error, task.taskId) << " ";
+        ReleaseTransferSlot();
+        ReleaseHost(task, 0);
+        ReportTaskResult(*task.job, task.url, task.expectedSize, false);
+        return;
+    }
+
+    Transfer* transfer = new Transfer();
+    transfer->task = move(task);
+    if (!SetupTransfer(curl, transfer->task, transfer->response)) {
+        loop.idleHandles.push_back(curl);
+        FailUnresolved(transfer->task);
+        delete transfer;
+        ReleaseTransferSlot();
+        return;
+    }
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+
+    Log(LogLevel::Info, transfer->task.taskId) << " : " << transfer->task.url
+        << (transfer->task.segmented ? " ( " + to_string(transfer->task.segment + 1) + ")" : "");
+    curl_multi_add_handle(loop.multi, curl);
+    loop.running++;
+}
+
+void StartMultiTransfers(MultiLoop& loop, int limit) {
+    DownloadTask task;
+    while (loop.running < limit && AcquireTransferSlot(false)) {
+        if (!TryPopTask(task)) {
+            ReleaseTransferSlot();
+            break;
+        }
+        StartMultiTransfer(loop, move(task));
+    }
+}
+
+void FinishMultiTransfers(MultiLoop& loop) {
+    CURLMsg* msg;
+    int pending;
+    while ((msg = curl_multi_info_read(loop.multi, &pending)) != nullptr) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        CURL* curl = msg->easy_handle;
+        CURLcode res = msg->data.result;
+        Transfer* transfer = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &transfer);
+        if (transfer->response.paused) {
+            loop.paused.erase(find(loop.paused.begin(), loop.paused.end(), curl));
+        }
+
+        FinishTransfer(curl, res, transfer->task, transfer->response);
+
+        curl_multi_remove_handle(loop.multi, curl);
+        loop.idleHandles.push_back(curl);
+        delete transfer;
+        loop.running--;
+        ReleaseTransferSlot();
+    }
+}
+
+//    ,  ;     .
+void ResumePausedTransfers(MultiLoop& loop) {
+    if (loop.paused.empty() || !ChunksAvailable()) {
+        return;
+    }
+    vector<CURL*> resumed;
+    resumed.swap(loop.paused);
+    for (CURL* curl : resumed) {
+        Transfer* transfer = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &transfer);
+        transfer->response.paused = false;
+        curl_easy_pause(curl, CURLPAUSE_CONT);
+    }
+}
+
+void MultiEngineThread(int index, int maxInFlight) {
+    workerIndex = index;
+    activeThreads++;
+
+    MultiLoop loop;
+    loop.multi = curl_multi_init();
+    if (!loop.multi) {
+        Log(LogLevel::Error) << "CURL   multi";
+        activeThreads--;
+        return;
+    }
+
+#ifdef __linux__
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    curl_multi_setopt(loop.multi, CURLMOPT_SOCKETFUNCTION, MultiSocketCallback);
+    curl_multi_setopt(loop.multi, CURLMOPT_SOCKETDATA, &loop);
+    curl_multi_setopt(loop.multi, CURLMOPT_TIMERFUNCTION, MultiTimerCallback);
+    curl_multi_setopt(loop.multi, CURLMOPT_TIMERDATA, &loop);
+    vector<epoll_event> events(256);
+#endif
+    pausedTransfers = &loop.paused;
+    if (!options.http2.empty()) {
+        curl_multi_setopt(loop.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(loop.multi, CURLMOPT_MAX_CONCURRENT_STREAMS, static_cast<long>(options.maxStreams));
+    }
+
+    while (true) {
+        StartMultiTransfers(loop, maxInFlight);
+
+        if (loop.running == 0) {
+            DownloadTask task;
+            if (!AcquireTransferSlot(true)) {
+                break;
+            }
+            if (!PopTask(task)) {
+                ReleaseTransferSlot();
+                break;
+            }
+            StartMultiTransfer(loop, move(task));
+            continue;
+        }
+
+        int stillRunning = 0;
+        ResumePausedTransfers(loop);
+#ifdef __linux__
+        //    100 ,      ,
+        //    5 ,   ,  .
+        int waitMs = loop.paused.empty() ? 100 : 5;
+        if (loop.timerSet) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(loop.deadline - chrono::steady_clock::now()).count();
+            waitMs = static_cast<int>(left < 0 ? 0 : (left < waitMs ? left : waitMs));
+        }
+
+        int n = epoll_wait(loop.epfd, events.data(), static_cast<int>(events.size()), waitMs);
+        for (int i = 0; i < n; ++i) {
+            int flags = 0;
+            if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(loop.multi, events[i].data.fd, flags, &stillRunning);
+        }
+        if (loop.timerSet && chrono::steady_clock::now() >= loop.deadline) {
+            loop.timerSet = false;
+            curl_multi_socket_action(loop.multi, CURL_SOCKET_TIMEOUT, 0, &stillRunning);
+        }
+#else
+        curl_multi_perform(loop.multi, &stillRunning);
+        curl_multi_poll(loop.multi, nullptr, 0, loop.paused.empty() ? 100 : 5, nullptr);
+#endif
+        FinishMultiTransfers(loop);
+    }
+
+#ifdef __linux__
+    close(loop.epfd);
+#endif
+    for (CURL* curl : loop.idleHandles) {
+        curl_easy_cleanup(curl);
+    }
+    curl_multi_cleanup(loop.multi);
+    activeThreads--;
+}
+
+//   URL :     (  ,
+//    ),       
+//  ,  ,     .
+//     queueBound ,  ,   
+//    ,    .
+struct ParsedUrl {
+    string url;
+    uint64_t fingerprint = 0;
+};
+
+struct IngestStats {
+    size_t urls = 0;
+    size_t duplicates = 0;
+    size_t skipped = 0;
+    size_t resumed = 0;
+    string error;
+};
+
+const size_t IngestBlockSize = 8 * 1024 * 1024;
+const size_t IngestBatchSize = 1024;
+
+//  64-   URL   :
+// 8   URL   .    
+// 20M URL  1e-5.
+struct FingerprintSet {
+    vector<uint64_t> slots;
+    size_t count = 0;
+
+    bool Insert(uint64_t fingerprint) {
+        if (fingerprint == 0) {
+            fingerprint = 1;
+        }
+        if ((count + 1) * 10 > slots.size() * 7) {
+            Grow();
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = fingerprint & mask;; i = (i + 1) & mask) {
+            if (slots[i] == fingerprint) {
+                return false;
+            }
+            if (slots[i] == 0) {
+                slots[i] = fingerprint;
+                count++;
+                return true;
+            }
+        }
+    }
+
+    void Grow() {
+        vector<uint64_t> old(slots.empty() ? size_t(1) << 16 : slots.size() * 2, 0);
+        old.swap(slots);
+        count = 0;
+        for (uint64_t fingerprint : old) {
+            if (fingerprint != 0) {
+                Insert(fingerprint);
+            }
+        }
+    }
+};
+
+//    :      ,  #.
+uint64_t UrlFingerprint(const string& url) {
+    string key = url.substr(0, url.find('#'));
+    size_t scheme = key.find("://");
+    size_t hostEnd = key.find_first_of("/?", scheme == string::npos ? 0 : scheme + 3);
+    if (hostEnd == string::npos) {
+        hostEnd = key.size();
+    }
+    for (size_t i = 0; i < hostEnd; ++i) {
+        key[i] = static_cast<char>(tolower(static_cast<unsigned char>(key[i])));
+    }
+    return HashBytes(key.data(), key.size());
+}
+
+void ParseUrlLines(const char* begin, const char* end, vector<ParsedUrl>& out) {
+    while (begin < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(begin, '\n', end - begin));
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+        const char* first = begin;
+        const char* last = lineEnd;
+        while (first < last && (*first == ' ' || *first == '\t')) first++;
+        while (last > first && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r')) last--;
+        if (first < last) {
+            ParsedUrl parsed;
+            parsed.url.assign(first, last);
+            parsed.fingerprint = UrlFingerprint(parsed.url);
+            out.push_back(move(parsed));
+        }
+        begin = lineEnd + 1;
+    }
+}
+
+//   ( )  parts ,   .
+void ParseUrlBlock(const char* begin, const char* end, vector<vector<ParsedUrl>>& parts) {
+    size_t count = parts.size();
+    vector<const char*> bounds{ begin };
+    for (size_t i = 1; i < count; ++i) {
+        const char* cut = begin + (end - begin) * i / count;
+        cut = max(cut, bounds.back());
+        const char* newline = static_cast<const char*>(memchr(cut, '\n', end - cut));
+        bounds.push_back(newline ? newline + 1 : end);
+    }
+    bounds.push_back(end);
+
+    vector<thread> parsers;
+    for (size_t i = 1; i < count; ++i) {
+        parsers.emplace_back(ParseUrlLines, bounds[i], bounds[i + 1], ref(parts[i]));
+    }
+    ParseUrlLines(bounds[0], bounds[1], parts[0]);
+    for (auto& parser : parsers) {
+        parser.join();
+    }
+}
+
+//   ,    .
+bool ForEachUrlBlock(const string& filename, const function<void(const char*, const char*)>& handle) {
+    MappedFile mapped;
+    if (mapped.Open(filename, true)) {
+        const char* end = mapped.data + mapped.size;
+        for (const char* block = mapped.data; block < end;) {
+            const char* blockEnd = block + min(static_cast<size_t>(end - block), IngestBlockSize);
+            if (blockEnd < end) {
+                const char* newline = static_cast<const char*>(memchr(blockEnd, '\n', end - blockEnd));
+                blockEnd = newline ? newline + 1 : end;
+            }
+            handle(block, blockEnd);
+            block = blockEnd;
+        }
+        return true;
+    }
+
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    string buffer;
+    vector<char> chunk(IngestBlockSize);
+    while (file) {
+        file.read(chunk.data(), chunk.size());
+        buffer.append(chunk.data(), static_cast<size_t>(file.gcount()));
+        size_t lastNewline = buffer.rfind('\n');
+        if (lastNewline != string::npos && (file || lastNewline + 1 == buffer.size())) {
+            handle(buffer.data(), buffer.data() + lastNewline + 1);
+            buffer.erase(0, lastNewline + 1);
+        }
+    }
+    if (!buffer.empty()) {
+        handle(buffer.data(), buffer.data() + buffer.size());
+    }
+    return true;
+}
+
+void SubmitIngestBatch(vector<DownloadTask>& batch) {
+    WaitQueueBelowBound();
+    if (batch.empty()) {
+        return;
+    }
+    PreResolveHosts(batch);
+    totalTasks += static_cast<int>(batch.size());
+    tasksLatch.Add(static_cast<long long>(batch.size()));
+    if (JobProgress* progress = batch.front().job->progress.get()) {
+        progress->total += static_cast<int>(batch.size());
+        progress->latch.Add(static_cast<long long>(batch.size()));
+    }
+    AddQueueBulk(batch);
+}
+
+//     : false -   .
+bool PrepareFromJournal(DownloadTask& task, IngestStats& stats) {
+    auto entry = journal.entries.find(task.url);
+    if (entry == journal.entries.end()) {
+        JournalRecord('Q', task.url);
+        return true;
+    }
+    if (entry->second.state == 'D') {
+        stats.skipped++;
+        return false;
+    }
+    error_code ec;
+    if (!entry->second.tempPath.empty() && filesystem::exists(entry->second.tempPath, ec)) {
+        //  -    'P';     
+        //    ,    .
+        curl_off_t size = static_cast<curl_off_t>(filesystem::file_size(entry->second.tempPath, ec));
+        curl_off_t written = min(size, entry->second.bytes);
+        if (entry->second.resumable && !ec && written > 0 && size > written) {
+            filesystem::resize_file(entry->second.tempPath, static_cast<uintmax_t>(written), ec);
+        }
+        if (entry->second.resumable && !ec && written > 0) {
+            task.resumePath = entry->second.tempPath;
+            task.resumeFrom = written;
+            stats.resumed++;
+        }
+        else {
+            filesystem::remove(entry->second.tempPath, ec);
+        }
+    }
+    return true;
+}
+
+//   ,       .
+atomic<int> nextTaskId{ 1 };
+
+// --probe:   HEAD-     Range,
+//  probeConcurrency     multi   
+// HostLimit  ,   ;   DNS   
+// share   .
+void ProbeSizes(vector<DownloadTask>& tasks) {
+    CURLM* multi = curl_multi_init();
+    if (!multi) {
+        return;
+    }
+    if (!options.http2.empty()) {
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
+
+    struct Probe {
+        size_t index = 0;
+        ResponseData response;
+    };
+    unordered_map<string, deque<size_t>> waiting;
+    unordered_map<string, int> inFlight;
+    deque<string> hosts;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (tasks[i].host.empty()) {
+            tasks[i].host = ExtractHost(tasks[i].url);
+        }
+        deque<size_t>& queue = waiting[tasks[i].host];
+        if (queue.empty()) {
+            hosts.push_back(tasks[i].host);
+        }
+        queue.push_back(i);
+    }
+
+    vector<CURL*> idle;
+    int running = 0;
+    int ranges = 0;
+    long long known = 0;
+    auto started = chrono::steady_clock::now();
+
+    while (!hosts.empty() || running > 0) {
+        for (size_t checked = hosts.size(); checked > 0 && running < options.probeConcurrency; --checked) {
+            string host = move(hosts.front());
+            hosts.pop_front();
+            deque<size_t>& queue = waiting[host];
+            int limit = HostLimit(host);
+            while (!queue.empty() && running < options.probeConcurrency && (limit <= 0 || inFlight[host] < limit)) {
+                CURL* curl = idle.empty() ? curl_easy_init() : idle.back();
+                if (!idle.empty()) {
+                    idle.pop_back();
+                    curl_easy_reset(curl);
+                }
+                if (!curl) {
+                    break;
+                }
+                DownloadTask& task = tasks[queue.front()];
+                queue.pop_front();
+                Probe* probe = new Probe();
+                probe->index = &task - tasks.data();
+                probe->response.task = &task;
+                // ,   ,  :   .
+                if (!ApplyDnsCache(curl, task, probe->response)) {
+                    delete probe;
+                    idle.push_back(curl);
+                    continue;
+                }
+                inFlight[host]++;
+                curl_easy_setopt(curl, CURLOPT_URL, task.url.c_str());
+                curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+                curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+                curl_easy_setopt(curl, CURLOPT_TIMEOUT, 15L);
+                curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36");
+                curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+                curl_easy_setopt(curl, CURLOPT_HEADERDATA, &probe->response);
+                curl_easy_setopt(curl, CURLOPT_PRIVATE, probe);
+                if (curlShare) {
+                    curl_easy_setopt(curl, CURLOPT_SHARE, curlShare);
+                }
+                SetupHttpVersion(curl, task, probe->response);
+                curl_multi_add_handle(multi, curl);
+                running++;
+            }
+            if (!queue.empty()) {
+                hosts.push_back(move(host));
+            }
+        }
+
+        int stillRunning = 0;
+        curl_multi_perform(multi, &stillRunning);
+        CURLMsg* msg;
+        int pending;
+        while ((msg = curl_multi_info_read(multi, &pending)) != nullptr) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL* curl = msg->easy_handle;
+            Probe* probe = nullptr;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, &probe);
+            const ResponseData& response = probe->response;
+            inFlight[tasks[probe->index].host]--;
+            //   HEAD   Content-Length -   .
+            if (msg->data.result == CURLE_OK && response.responseCode >= 200 && response.responseCode < 300 &&
+                response.contentLength >= 0) {
+                DownloadTask& task = tasks[probe->index];
+                task.expectedSize = response.contentLength > task.resumeFrom ? response.contentLength - task.resumeFrom : 0;
+                known++;
+                ranges += response.acceptRanges ? 1 : 0;
+            }
+            curl_multi_remove_handle(multi, curl);
+            idle.push_back(curl);
+            delete probe;
+            running--;
+        }
+        if (running > 0) {
+            curl_multi_poll(multi, nullptr, 0, 100, nullptr);
+        }
+    }
+    for (CURL* curl : idle) {
+        curl_easy_cleanup(curl);
+    }
+    curl_multi_cleanup(multi);
+
+    long long bytes = 0;
+    for (const DownloadTask& task : tasks) {
+        bytes += max<curl_off_t>(task.expectedSize, 0);
+    }
+    expectedBytes += bytes;
+    ostringstream megabytes;
+    megabytes << fixed << setprecision(1) << bytes / 1048576.0;
+    Log(LogLevel::Info) << "[] " << tasks.size() << " URL  " << chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now() - started).count() << " :    " << known << " (" << megabytes.str()
+        << " MB), Range  " << ranges;
+}
+
+//    (LPT):   ,   
+//  ,      ,  
+//    .      .
+//  :      ,  
+//        ,    
+//     .
+void OrderLargestFirst(vector<DownloadTask>& tasks) {
+    long long sum = 0;
+    long long count = 0;
+    for (const DownloadTask& task : tasks) {
+        if (task.expectedSize >= 0) {
+            sum += task.expectedSize;
+            count++;
+        }
+    }
+    curl_off_t unknown = count > 0 ? sum / count : 0;
+    stable_sort(tasks.begin(), tasks.end(), [unknown](const DownloadTask& a, const DownloadTask& b) {
+        return (a.expectedSize >= 0 ? a.expectedSize : unknown) > (b.expectedSize >= 0 ? b.expectedSize : unknown);
+    });
+}
+
+// - .    tasksLatch,   .
+//  --probe    ,     .
+void IngestUrls(const string& filename, shared_ptr<const DownloadJob> job, IngestStats& stats) {
+    FingerprintSet seen;
+    vector<DownloadTask> batch;
+    vector<vector<ParsedUrl>> parts(max(1u, min(4u, thread::hardware_concurrency())));
+
+    bool opened = ForEachUrlBlock(filename, [&](const char* begin, const char* end) {
+        for (auto& part : parts) {
+            part.clear();
+        }
+        ParseUrlBlock(begin, end, parts);
+
+        for (auto& part : parts) {
+            for (ParsedUrl& parsed : part) {
+                stats.urls++;
+                if (!seen.Insert(parsed.fingerprint)) {
+                    stats.duplicates++;
+                    continue;
+                }
+                DownloadTask task;
+                task.url = move(parsed.url);
+                task.job = job;
+                task.taskId = nextTaskId++;
+                if (!PrepareFromJournal(task, stats)) {
+                    continue;
+                }
+                if (task.taskId <= 3 && !job->progress) {
+                    cout << "  " << task.taskId << ". " << task.url << endl;
+                }
+                batch.push_back(move(task));
+                if (batch.size() >= IngestBatchSize && !options.probe) {
+                    SubmitIngestBatch(batch);
+                }
+            }
+        }
+    });
+    if (options.probe && !batch.empty()) {
+        PreResolveHosts(batch);
+        ProbeSizes(batch);
+        OrderLargestFirst(batch);
+        progressStarted = chrono::steady_clock::now();
+        vector<DownloadTask> part;
+        for (DownloadTask& task : batch) {
+            part.push_back(move(task));
+            if (part.size() >= IngestBatchSize) {
+                SubmitIngestBatch(part);
+            }
+        }
+        batch.swap(part);
+    }
+    SubmitIngestBatch(batch);
+
+    if (!opened) {
+        stats.error = "  : " + filename;
+    }
+    else if (stats.urls == 0) {
+        stats.error = "      URL";
+    }
+    tasksLatch.CountDown();
+}
+
+//   (--bench-dispatch):    
+//  (queue + mutex + condition_variable,    WorkerThread), 
+//          -    
+//    .  -      , 
+//   .
+double BenchBaselineQueue(int workers, const vector<DownloadTask>& source) {
+    queue<DownloadTask> benchQueue;
+    mutex benchMutex;
+    condition_variable benchCondition;
+    bool benchStop = false;
+    atomic<int> done{ 0 };
+
+    auto started = chrono::steady_clock::now();
+    for (const DownloadTask& task : source) {
+        lock_guard<mutex> lock(benchMutex);
+        benchQueue.push(task);
+        benchCondition.notify_one();
+    }
+
+    vector<thread> threads;
+    for (int i = 0; i < workers; ++i) {
+        threads.emplace_back([&] {
+            while (true) {
+                DownloadTask task;
+                {
+                    unique_lock<mutex> lock(benchMutex);
+                    benchCondition.wait(lock, [&] { return benchStop || !benchQueue.empty(); });
+                    if (benchStop && benchQueue.empty()) {
+                        break;
+                    }
+                    task = move(benchQueue.front());
+                    benchQueue.pop();
+                }
+                done++;
+            }
+        });
+    }
+    while (done < static_cast<int>(source.size())) {
+        this_thread::yield();
+    }
+    auto finished = chrono::steady_clock::now();
+    {
+        lock_guard<mutex> lock(benchMutex);
+        benchStop = true;
+    }
+    benchCondition.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+    return chrono::duration<double, nano>(finished - started).count() / source.size();
+}
+
+double BenchDispatcher(int workers, const vector<DownloadTask>& source, bool workStealing, int perHost) {
+    hostScheduler = !workStealing;
+    options.perHostLimit = perHost;
+    InitDispatcher(workers);
+    stopThreads = false;
+
+    vector<DownloadTask> tasks(source);
+    auto started = chrono::steady_clock::now();
+    tasksLatch.Add(static_cast<long long>(tasks.size()));
+    AddQueueBulk(tasks);
+
+    vector<thread> threads;
+    for (int i = 0; i < workers; ++i) {
+        threads.emplace_back([i] {
+            workerIndex = i;
+            DownloadTask task;
+            while (PopTask(task)) {
+                ReleaseHost(task, 0);
+                tasksLatch.CountDown();
+            }
+        });
+    }
+    while (!tasksLatch.WaitFor(chrono::seconds(1))) {
+    }
+    auto finished = chrono::steady_clock::now();
+
+    stopThreads = true;
+    WakeAllWorkers();
+    for (auto& t : threads) {
+        t.join();
+    }
+    return chrono::duration<double, nano>(finished - started).count() / source.size();
+}
+
+void RunDispatchBenchmark() {
+    const int taskCount = 200000;
+    vector<DownloadTask> source;
+    source.reserve(taskCount);
+    for (int i = 0; i < taskCount; ++i) {
+        DownloadTask task;
+        task.url = "http://host" + to_string(i % 16) + ".example/file" + to_string(i);
+        task.taskId = i + 1;
+        task.host = ExtractHost(task.url);
+        source.push_back(move(task));
+    }
+
+    //   -     (--per-host,   8).
+    int perHost = options.perHostLimit;
+    cout << ": " << taskCount << ",  16, --per-host=" << perHost << ",   " << endl;
+    cout << setw(8) << "" << setw(14) << "mutex FIFO" << setw(14) << " " << setw(14) << ""
+        << setw(18) << "  " << endl;
+    for (int workers : { 1, 4, 16, 64, 256 }) {
+        double baseline = BenchBaselineQueue(workers, source);
+        double hosts = BenchDispatcher(workers, source, false, perHost);
+        double stealing = BenchDispatcher(workers, source, true, perHost);
+        double unlimited = BenchDispatcher(workers, source, true, 0);
+        cout << fixed << setprecision(1) << setw(8) << workers << setw(14) << baseline << setw(14) << hosts
+            << setw(14) << stealing << setw(18) << unlimited << defaultfloat << endl;
+    }
+    options.perHostLimit = perHost;
+    hostScheduler = false;
+}
+
+//    (  ) -: cout  endl 
+// stringstream + localtime   .
+double BenchLegacyLog(int workers, int tasksPerWorker, ostream& sink) {
+    auto legacyTime = []() {
+        auto now = chrono::system_clock::now();
+        auto time_t = chrono::system_clock::to_time_t(now);
+        auto ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()) % 1000;
+        stringstream ss;
+        ss << put_time(localtime(&time_t), "%H:%M:%S");
+        ss << "." << setfill('0') << setw(3) << ms.count();
+        return ss.str();
+    };
+    streambuf* saved = cout.rdbuf(sink.rdbuf());
+    auto started = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int w = 0; w < workers; ++w) {
+        threads.emplace_back([&, w]() {
+            for (int i = 0; i < tasksPerWorker; ++i) {
+                int taskId = w * tasksPerWorker + i + 1;
+                cout << "[" << legacyTime() << "] [ " << taskId << "]  : http://example.com/file" << taskId << endl;
+                cout << "[" << legacyTime() << "[ " << taskId << "]  : /tmp/file" << taskId
+                    << " (" << 12345 << " bytes)" << endl;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto elapsed = chrono::steady_clock::now() - started;
+    cout.rdbuf(saved);
+    return chrono::duration<double, nano>(elapsed).count() / (workers * tasksPerWorker);
+}
+
+//     Log,      .
+double BenchAsyncLog(int workers, int tasksPerWorker, FILE* sink) {
+    logger.out = sink;
+    logger.err = sink;
+    StartLogger(LogLevel::Info, string());
+    auto started = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int w = 0; w < workers; ++w) {
+        threads.emplace_back([&, w]() {
+            for (int i = 0; i < tasksPerWorker; ++i) {
+                int taskId = w * tasksPerWorker + i + 1;
+                Log(LogLevel::Info, taskId) << " : http://example.com/file" << taskId;
+                Log(LogLevel::Info, taskId) << " : /tmp/file" << taskId << " (" << 12345 << " bytes)";
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    StopLogger();
+    auto elapsed = chrono::steady_clock::now() - started;
+    logger.out = stdout;
+    logger.err = stderr;
+    return chrono::duration<double, nano>(elapsed).count() / (workers * tasksPerWorker);
+}
+
+void RunLogBenchmark() {
+    const int taskCount = 200000;
+    filesystem::path sinkPath = filesystem::temp_directory_path() / "downloader-bench-log.txt";
+
+    cout << ": " << taskCount << ",     ,   " << endl;
+    cout << setw(8) << "" << setw(14) << "cout+endl" << setw(14) << "Log" << endl;
+    for (int workers : { 1, 4, 16 }) {
+        double legacy;
+        {
+            ofstream sink(sinkPath, ios::trunc);
+            legacy = BenchLegacyLog(workers, taskCount / workers, sink);
+        }
+        FILE* sink = fopen(sinkPath.string().c_str(), "wb");
+        if (!sink) {
+            cerr << ":    " << sinkPath.string() << endl;
+            return;
+        }
+        double async = BenchAsyncLog(workers, taskCount / workers, sink);
+        fclose(sink);
+        cout << fixed << setprecision(1) << setw(8) << workers << setw(14) << legacy << setw(14) << async << defaultfloat << endl;
+    }
+    error_code ec;
+    filesystem::remove(sinkPath, ec);
+}
+
+//   (--bench): HTTP/1.1      
+//  ,     
+// AddQueueBulk -> WorkerThread/MultiEngineThread -> FinishTransfer.
+//  /file/<id>?size=<>   ;   Range,
+// ETag / If-None-Match, HEAD  keep-alive,   , 
+//       --bench-*.
+struct BenchServerConfig {
+    int latencyMs = 0;
+    curl_off_t bandwidth = 0;
+    double errorRate = 0;
+};
+
+struct BenchServer {
+    BenchServerConfig config;
+    curl_socket_t listener = CURL_SOCKET_BAD;
+    int port = 0;
+    thread acceptor;
+    atomic<bool> stopping{ false };
+
+    mutex connectionsMutex;
+    vector<thread> connections;
+    vector<curl_socket_t> sockets;
+};
+
+void CloseSocket(curl_socket_t socket) {
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif
+}
+
+bool SendAll(curl_socket_t socket, const char* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while (size > 0) {
+        int sent = send(socket, data, static_cast<int>(min(size, size_t(1) << 20)), flags);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+//   id    id  ,  Range
+//       .
+void FillBenchContent(char* out, size_t size, uint64_t id, curl_off_t offset) {
+    for (size_t i = 0; i < size; ++i) {
+        uint64_t position = static_cast<uint64_t>(offset) + i;
+        out[i] = static_cast<char>((position * 131 + id * 7 + (position >> 12)) & 0xff);
+    }
+}
+
+//    ; false -   .
+bool ServeBenchRequest(BenchServer& server, curl_socket_t socket, const string& request, mt19937& random) {
+    size_t lineEnd = request.find("\r\n");
+    istringstream requestLine(request.substr(0, lineEnd));
+    string method, target, version;
+    requestLine >> method >> target >> version;
+
+    auto header = [&](const char* name) {
+        size_t nameLength = strlen(name);
+        for (size_t pos = lineEnd; pos != string::npos && pos + 2 < request.size(); pos = request.find("\r\n", pos + 2)) {
+            string line = request.substr(pos + 2, request.find("\r\n", pos + 2) - pos - 2);
+            string lower = line.substr(0, nameLength + 1);
+            transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+            if (lower == string(name) + ":") {
+                return string(HeaderValue(line, nameLength));
+            }
+        }
+        return string();
+    };
+    bool keepAlive = version == "HTTP/1.1" && header("connection") != "close";
+
+    if (server.config.latencyMs > 0) {
+        this_thread::sleep_for(chrono::milliseconds(server.config.latencyMs));
+    }
+    if (server.config.errorRate > 0 && uniform_real_distribution<double>(0, 1)(random) < server.config.errorRate) {
+        //   - 500,  -  .
+        if (random() % 2) {
+            return false;
+        }
+        const char response[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        return SendAll(socket, response, sizeof(response) - 1) && keepAlive;
+    }
+
+    unsigned long long id = 0;
+    long long size = -1;
+    if (sscanf(target.c_str(), "/file/%llu?size=%lld", &id, &size) != 2 || size < 0) {
+        const char response[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        return SendAll(socket, response, sizeof(response) - 1) && keepAlive;
+    }
+
+    string etag = "\"" + to_string(id) + "-" + to_string(size) + "\"";
+    string common = "ETag: " + etag + "\r\nLast-Modified: Thu, 01 Jan 2026 00:00:00 GMT\r\nAccept-Ranges: bytes\r\n" +
+        "Content-Type: application/octet-stream\r\n" + (keepAlive ? "" : "Connection: close\r\n");
+    if (header("if-none-match") == etag) {
+        string response = "HTTP/1.1 304 Not Modified\r\n" + common + "\r\n";
+        return SendAll(socket, response.data(), response.size()) && keepAlive;
+    }
+
+    curl_off_t first = 0;
+    curl_off_t last = size - 1;
+    string status = "200 OK";
+    string range = header("range");
+    long long rangeFirst = 0, rangeLast = -1;
+    if (range.compare(0, 6, "bytes=") == 0 && sscanf(range.c_str() + 6, "%lld-%lld", &rangeFirst, &rangeLast) >= 1 &&
+        rangeFirst < size) {
+        first = rangeFirst;
+        last = rangeLast >= rangeFirst && rangeLast < size ? rangeLast : size - 1;
+        status = "206 Partial Content";
+        common += "Content-Range: bytes " + to_string(first) + "-" + to_string(last) + "/" + to_string(size) + "\r\n";
+    }
+
+    string response = "HTTP/1.1 " + status + "\r\n" + common + "Content-Length: " + to_string(last - first + 1) + "\r\n\r\n";
+    if (!SendAll(socket, response.data(), response.size())) {
+        return false;
+    }
+    if (method == "HEAD") {
+        return keepAlive;
+    }
+
+    vector<char> chunk(64 * 1024);
+    auto started = chrono::steady_clock::now();
+    curl_off_t sent = 0;
+    for (curl_off_t offset = first; offset <= last && !server.stopping;) {
+        size_t length = static_cast<size_t>(min<curl_off_t>(chunk.size(), last - offset + 1));
+        FillBenchContent(chunk.data(), length, id, offset);
+        if (!SendAll(socket, chunk.data(), length)) {
+            return false;
+        }
+        offset += length;
+        sent += length;
+        if (server.config.bandwidth > 0) {
+            this_thread::sleep_until(started + chrono::microseconds(sent * 1000000 / server.config.bandwidth));
+        }
+    }
+    return keepAlive;
+}
+
+#ifdef HAVE_NGHTTP2
+// h2c (HTTP/2  TLS, prior knowledge)  --bench:   ,   
+// ServeBenchRequest,     -   
+// nghttp2.     :   
+//   ,      .
+struct BenchStream {
+    string path;
+    string method;
+    string range;
+    string ifNoneMatch;
+    unsigned long long fileId = 0;
+    curl_off_t offset = 0;
+    curl_off_t last = -1;
+};
+
+struct BenchHttp2Connection {
+    BenchServer& server;
+    curl_socket_t socket;
+    mt19937& random;
+    nghttp2_session* session = nullptr;
+    unordered_map<int32_t, unique_ptr<BenchStream>> streams;
+    vector<pair<chrono::steady_clock::time_point, int32_t>> delayed;
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+    curl_off_t sent = 0;
+
+    BenchHttp2Connection(BenchServer& server, curl_socket_t socket, mt19937& random)
+        : server(server), socket(socket), random(random) {}
+};
+
+ssize_t BenchHttp2Send(nghttp2_session*, const uint8_t* data, size_t length, int, void* userData) {
+    BenchHttp2Connection& connection = *static_cast<BenchHttp2Connection*>(userData);
+    if (!SendAll(connection.socket, reinterpret_cast<const char*>(data), length)) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    //   -  :    .
+    connection.sent += length;
+    if (connection.server.config.bandwidth > 0) {
+        this_thread::sleep_until(connection.started + chrono::microseconds(connection.sent * 1000000 / connection.server.config.bandwidth));
+    }
+    return static_cast<ssize_t>(length);
+}
+
+int BenchHttp2BeginHeaders(nghttp2_session*, const nghttp2_frame* frame, void* userData) {
+    BenchHttp2Connection& connection = *static_cast<BenchHttp2Connection*>(userData);
+    if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST) {
+        connection.streams[frame->hd.stream_id].reset(new BenchStream());
+    }
+    return 0;
+}
+
+int BenchHttp2Header(nghttp2_session*, const nghttp2_frame* frame, const uint8_t* name, size_t nameLength,
+    const uint8_t* value, size_t valueLength, uint8_t, void* userData) {
+    BenchHttp2Connection& connection = *static_cast<BenchHttp2Connection*>(userData);
+    auto it = connection.streams.find(frame->hd.stream_id);
+    if (it == connection.streams.end()) {
+        return 0;
+    }
+    string headerName(reinterpret_cast<const char*>(name), nameLength);
+    string headerValue(reinterpret_cast<const char*>(value), valueLength);
+    if (headerName == ":path") it->second->path = headerValue;
+    else if (headerName == ":method") it->second->method = headerValue;
+    else if (headerName == "range") it->second->range = headerValue;
+    else if (headerName == "if-none-match") it->second->ifNoneMatch = headerValue;
+    return 0;
+}
+
+ssize_t BenchHttp2Read(nghttp2_session*, int32_t, uint8_t* buffer, size_t length, uint32_t* flags,
+    nghttp2_data_source* source, void*) {
+    BenchStream& stream = *static_cast<BenchStream*>(source->ptr);
+    size_t chunk = static_cast<size_t>(min<curl_off_t>(length, stream.last - stream.offset + 1));
+    FillBenchContent(reinterpret_cast<char*>(buffer), chunk, stream.fileId, stream.offset);
+    stream.offset += chunk;
+    if (stream.offset > stream.last) {
+        *flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return static_cast<ssize_t>(chunk);
+}
+
+void SubmitBenchResponse(BenchHttp2Connection& connection, int32_t streamId) {
+    auto it = connection.streams.find(streamId);
+    if (it == connection.streams.end()) {
+        return;
+    }
+    BenchStream& stream = *it->second;
+    vector<pair<string, string>> headers;
+    auto submit = [&](nghttp2_data_provider* body) {
+        vector<nghttp2_nv> nv;
+        for (auto& header : headers) {
+            nv.push_back(nghttp2_nv{ reinterpret_cast<uint8_t*>(&header.first[0]), reinterpret_cast<uint8_t*>(&header.second[0]),
+                header.first.size(), header.second.size(), NGHTTP2_NV_FLAG_NONE });
+        }
+        nghttp2_submit_response(connection.session, streamId, nv.data(), nv.size(), body);
+    };
+
+    if (connection.server.config.errorRate > 0 &&
+        uniform_real_distribution<double>(0, 1)(connection.random) < connection.server.config.errorRate) {
+        //    HTTP/1.1:   - 500,  -  .
+        if (connection.random() % 2) {
+            nghttp2_submit_rst_stream(connection.session, NGHTTP2_FLAG_NONE, streamId, NGHTTP2_INTERNAL_ERROR);
+        }
+        else {
+            headers = { { ":status", "500" }, { "content-length", "0" } };
+            submit(nullptr);
+        }
+        return;
+    }
+
+    long long size = -1;
+    if (sscanf(stream.path.c_str(), "/file/%llu?size=%lld", &stream.fileId, &size) != 2 || size < 0) {
+        headers = { { ":status", "404" }, { "content-length", "0" } };
+        submit(nullptr);
+        return;
+    }
+
+    string etag = "\"" + to_string(stream.fileId) + "-" + to_string(size) + "\"";
+    headers = { { ":status", "200" }, { "etag", etag }, { "last-modified", "Thu, 01 Jan 2026 00:00:00 GMT" },
+        { "accept-ranges", "bytes" }, { "content-type", "application/octet-stream" } };
+    if (stream.ifNoneMatch == etag) {
+        headers[0].second = "304";
+        submit(nullptr);
+        return;
+    }
+
+    stream.offset = 0;
+    stream.last = size - 1;
+    long long rangeFirst = 0, rangeLast = -1;
+    if (stream.range.compare(0, 6, "bytes=") == 0 && sscanf(stream.range.c_str() + 6, "%lld-%lld", &rangeFirst, &rangeLast) >= 1 &&
+        rangeFirst < size) {
+        stream.offset = rangeFirst;
+        stream.last = rangeLast >= rangeFirst && rangeLast < size ? rangeLast : size - 1;
+        headers[0].second = "206";
+        headers.emplace_back("content-range", "bytes " + to_string(stream.offset) + "-" + to_string(stream.last) + "/" + to_string(size));
+    }
+    headers.emplace_back("content-length", to_string(stream.last - stream.offset + 1));
+
+    nghttp2_data_provider body{};
+    body.source.ptr = &stream;
+    body.read_callback = BenchHttp2Read;
+    submit(stream.method == "HEAD" || stream.last < stream.offset ? nullptr : &body);
+}
+
+int BenchHttp2FrameReceived(nghttp2_session*, const nghttp2_frame* frame, void* userData) {
+    BenchHttp2Connection& connection = *static_cast<BenchHttp2Connection*>(userData);
+    if ((frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA) && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) &&
+        connection.streams.count(frame->hd.stream_id)) {
+        connection.delayed.emplace_back(chrono::steady_clock::now() + chrono::milliseconds(connection.server.config.latencyMs),
+            frame->hd.stream_id);
+    }
+    return 0;
+}
+
+int BenchHttp2StreamClosed(nghttp2_session*, int32_t streamId, uint32_t, void* userData) {
+    static_cast<BenchHttp2Connection*>(userData)->streams.erase(streamId);
+    return 0;
+}
+
+void BenchHttp2Loop(BenchServer& server, curl_socket_t socket, const string& received, mt19937& random) {
+    BenchHttp2Connection connection(server, socket, random);
+    nghttp2_session_callbacks* callbacks = nullptr;
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_send_callback(callbacks, BenchHttp2Send);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, BenchHttp2BeginHeaders);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, BenchHttp2Header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, BenchHttp2FrameReceived);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, BenchHttp2StreamClosed);
+    nghttp2_session_server_new(&connection.session, callbacks, &connection);
+    nghttp2_session_callbacks_del(callbacks);
+
+    nghttp2_settings_entry settings[] = { { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 1000 } };
+    nghttp2_submit_settings(connection.session, NGHTTP2_FLAG_NONE, settings, 1);
+
+    bool ok = nghttp2_session_mem_recv(connection.session, reinterpret_cast<const uint8_t*>(received.data()), received.size()) >= 0;
+    char chunk[16 * 1024];
+    while (ok && !server.stopping) {
+        auto now = chrono::steady_clock::now();
+        for (size_t i = 0; i < connection.delayed.size();) {
+            if (connection.delayed[i].first <= now) {
+                SubmitBenchResponse(connection, connection.delayed[i].second);
+                connection.delayed[i] = connection.delayed.back();
+                connection.delayed.pop_back();
+            }
+            else {
+                ++i;
+            }
+        }
+        if (nghttp2_session_send(connection.session) != 0) {
+            break;
+        }
+        if (!nghttp2_session_want_read(connection.session) && !nghttp2_session_want_write(connection.session)) {
+            break;
+        }
+
+        long long waitMicros = 100000;
+        for (auto& entry : connection.delayed) {
+            waitMicros = min<long long>(waitMicros, max<long long>(0,
+                chrono::duration_cast<chrono::microseconds>(entry.first - now).count()));
+        }
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(socket, &readable);
+        timeval timeout{ static_cast<long>(waitMicros / 1000000), static_cast<long>(waitMicros % 1000000) };
+        int ready = select(static_cast<int>(socket + 1), &readable, nullptr, nullptr, &timeout);
+        if (ready < 0) {
+            break;
+        }
+        if (ready > 0) {
+            int length = recv(socket, chunk, sizeof(chunk), 0);
+            ok = length > 0 && nghttp2_session_mem_recv(connection.session, reinterpret_cast<const uint8_t*>(chunk), length) >= 0;
+        }
+    }
+    nghttp2_session_del(connection.session);
+}
+#endif
+
+void BenchConnectionLoop(BenchServer& server, curl_socket_t socket, unsigned seed) {
+    mt19937 random(seed);
+    string buffer;
+    char chunk[16 * 1024];
+    while (!server.stopping) {
+#ifdef HAVE_NGHTTP2
+        //  HTTP/2 "PRI * HTTP/2.0" -    h2c.
+        if (buffer.size() >= 3 && buffer.compare(0, 3, "PRI") == 0) {
+            BenchHttp2Loop(server, socket, buffer, random);
+            break;
+        }
+#endif
+        size_t end = buffer.find("\r\n\r\n");
+        if (end == string::npos) {
+            int received = recv(socket, chunk, sizeof(chunk), 0);
+            if (received <= 0) {
+                break;
+            }
+            buffer.append(chunk, received);
+            continue;
+        }
+        string request = buffer.substr(0, end + 4);
+        buffer.erase(0, end + 4);
+        if (!ServeBenchRequest(server, socket, request, random)) {
+            break;
+        }
+    }
+    {
+        lock_guard<mutex> lock(server.connectionsMutex);
+        server.sockets.erase(remove(server.sockets.begin(), server.sockets.end(), socket), server.sockets.end());
+    }
+    CloseSocket(socket);
+}
+
+void BenchAcceptLoop(BenchServer& server) {
+    unsigned seed = 1;
+    while (!server.stopping) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(server.listener, &readable);
+        timeval timeout{ 0, 100000 };
+        if (select(static_cast<int>(server.listener + 1), &readable, nullptr, nullptr, &timeout) <= 0) {
+            continue;
+        }
+        curl_socket_t socket = accept(server.listener, nullptr, nullptr);
+        if (socket == CURL_SOCKET_BAD) {
+            continue;
+        }
+        int noDelay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        lock_guard<mutex> lock(server.connectionsMutex);
+        server.sockets.push_back(socket);
+        server.connections.emplace_back(BenchConnectionLoop, ref(server), socket, seed++);
+    }
+}
+
+bool StartBenchServer(BenchServer& server) {
+    server.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (server.listener == CURL_SOCKET_BAD) {
+        return false;
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    if (::bind(server.listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(server.listener, 1024) != 0 ||
+        getsockname(server.listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        CloseSocket(server.listener);
+        return false;
+    }
+    server.port = ntohs(address.sin_port);
+    server.stopping = false;
+    server.acceptor = thread(BenchAcceptLoop, ref(server));
+    return true;
+}
+
+void StopBenchServer(BenchServer& server) {
+    server.stopping = true;
+    server.acceptor.join();
+    CloseSocket(server.listener);
+    vector<thread> connections;
+    {
+        lock_guard<mutex> lock(server.connectionsMutex);
+        for (curl_socket_t socket : server.sockets) {
+#ifdef _WIN32
+            shutdown(socket, SD_BOTH);
+#else
+            shutdown(socket, SHUT_RDWR);
+#endif
+        }
+        connections.swap(server.connections);
+    }
+    for (auto& connection : connections) {
+        connection.join();
+    }
+}
+
+double ProcessCpuSeconds() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+    auto seconds = [](const FILETIME& time) {
+        return (static_cast<uint64_t>(time.dwHighDateTime) << 32 | time.dwLowDateTime) / 1e7;
+    };
+    return seconds(kernel) + seconds(user);
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+//        .
+long long PeakRssBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return static_cast<long long>(counters.PeakWorkingSetSize);
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024LL;
+#endif
+#endif
+}
+
+void PrintMemorySummary() {
+    long long requests = chunkHits + chunkMisses;
+    size_t peakChunks;
+    {
+        lock_guard<mutex> lock(chunkPool.poolMutex);
+        peakChunks = chunkPool.peakAllocated;
+    }
+    cout << ":  RSS " << fixed << setprecision(1) << PeakRssBytes() / 1048576.0 << " MB,   "
+        << peakChunks * SinkBufferSize / 1048576.0 << " MB  " << options.memoryBudget / 1048576.0 << " MB" << endl;
+    if (requests > 0) {
+        cout << " :   " << chunkHits * 100 / requests << "% (" << chunkHits << "/" << requests << ")";
+        if (pausedWrites > 0) {
+            cout << ",  -  " << pausedWrites;
+        }
+        cout << endl;
+    }
+}
+
+//  :   ;    ,  
+//  ,   .
+struct BenchMix {
+    string name;
+    int files;
+    vector<pair<double, curl_off_t>> sizes;
+};
+
+vector<BenchMix> BenchMixes() {
+    return {
+        { "small", 2000, { { 1.0, 16 * 1024 } } },
+        { "mixed", 300, { { 0.70, 16 * 1024 }, { 0.25, 512 * 1024 }, { 0.05, 4 * 1024 * 1024 } } },
+        { "large", 4, { { 1.0, 64 * 1024 * 1024 } } },
+    };
+}
+
+struct BenchResult {
+    int completed = 0;
+    int failed = 0;
+    double seconds = 0;
+    double cpuSeconds = 0;
+    curl_off_t bytes = 0;
+};
+
+//  :    , workers   .
+BenchResult RunBenchPass(const BenchServer& server, const BenchMix& mix, int workers, const filesystem::path& directory) {
+    mt19937 random(42);
+    uniform_real_distribution<double> pick(0, 1);
+    auto job = make_shared<DownloadJob>();
+    job->directoryPath = directory.string();
+
+    vector<DownloadTask> tasks;
+    curl_off_t bytes = 0;
+    for (int i = 0; i < mix.files; ++i) {
+        double roll = pick(random);
+        curl_off_t size = mix.sizes.back().second;
+        for (const auto& entry : mix.sizes) {
+            if (roll < entry.first) {
+                size = entry.second;
+                break;
+            }
+            roll -= entry.first;
+        }
+        DownloadTask task;
+        task.url = "http://127.0.0.1:" + to_string(server.port) + "/file/" + to_string(i) + "?size=" + to_string(size);
+        task.job = job;
+        task.taskId = i + 1;
+        tasks.push_back(move(task));
+        bytes += size;
+    }
+
+    InitDispatcher(workers);
+    stopThreads = false;
+    completedTasks = 0;
+    failedTasks = 0;
+    totalTasks = mix.files;
+    tasksLatch.Add(mix.files);
+    StartRetryWheel();
+    StartDiskWriter();
+
+    double cpuStarted = ProcessCpuSeconds();
+    auto started = chrono::steady_clock::now();
+    AddQueueBulk(tasks);
+    vector<thread> threads;
+    for (int i = 0; i < workers; ++i) {
+        if (options.engine == "multi") {
+            threads.emplace_back(MultiEngineThread, i, max(1, options.maxInFlight / workers));
+        }
+        else {
+            threads.emplace_back(WorkerThread, i);
+        }
+    }
+    while (!tasksLatch.WaitFor(chrono::milliseconds(100))) {
+        if (activeThreads == 0) {
+            break;
+        }
+    }
+    StopRetryWheel();
+    stopThreads = true;
+    WakeAllWorkers();
+    for (auto& t : threads) {
+        t.join();
+    }
+    ClosePackSegments();
+    StopDiskWriter();
+    ClosePackIndexes();
+
+    BenchResult result;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    result.cpuSeconds = ProcessCpuSeconds() - cpuStarted;
+    result.completed = completedTasks;
+    result.failed = failedTasks;
+    result.bytes = bytes;
+    return result;
+}
+
+int RunBenchSuite() {
+    BenchServer server;
+    server.config.latencyMs = options.benchLatencyMs;
+    server.config.bandwidth = options.benchBandwidth;
+    server.config.errorRate = options.benchErrorPercent / 100.0;
+    if (!StartBenchServer(server)) {
+        cerr << ":     " << endl;
+        return 1;
+    }
+
+    //      (   )  .
+#ifdef _WIN32
+    FILE* nullSink = fopen("NUL", "wb");
+#else
+    FILE* nullSink = fopen("/dev/null", "wb");
+#endif
+    LogLevel savedLevel = logger.level;
+    logger.level = LogLevel::Error;
+    if (nullSink) {
+        logger.out = nullSink;
+        logger.err = nullSink;
+    }
+
+    ofstream results;
+    if (!options.benchOut.empty()) {
+        results.open(options.benchOut, ios::app);
+    }
+    filesystem::path root = filesystem::temp_directory_path() / ("downloader-bench-" + to_string(server.port));
+
+    cout << ": 127.0.0.1:" << server.port << ",  " << options.engine
+        << ", HTTP/" << (options.http2 == "prior-knowledge" ? "2 (h2c)" : "1.1") << ",  " << server.config.latencyMs
+        << " ,  " << options.benchErrorPercent << "%" << endl;
+    cout << left << setw(8) << "" << right << setw(8) << "" << setw(10) << "/" << setw(10) << "MB/s"
+        << setw(12) << "CPU /GB" << setw(12) << "RSS MB" << setw(8) << "" << endl;
+
+    for (const BenchMix& mix : BenchMixes()) {
+        if (!options.benchMix.empty() && options.benchMix.find(mix.name) == string::npos) {
+            continue;
+        }
+        for (int workers : options.benchThreads) {
+            filesystem::path directory = root / (mix.name + "-" + to_string(workers));
+            BenchResult result = RunBenchPass(server, mix, workers, directory);
+            error_code ec;
+            filesystem::remove_all(directory, ec);
+
+            double mb = result.bytes / 1048576.0;
+            double filesPerSecond = result.completed / result.seconds;
+            double cpuPerGb = result.bytes > 0 ? result.cpuSeconds / (result.bytes / 1073741824.0) : 0;
+            double rssMb = PeakRssBytes() / 1048576.0;
+            cout << left << setw(8) << mix.name << right << setw(8) << workers << fixed << setprecision(1)
+                << setw(10) << filesPerSecond << setw(10) << mb / result.seconds << setw(12) << cpuPerGb
+                << setw(12) << rssMb << setw(8) << result.failed << defaultfloat << endl;
+            if (results.is_open()) {
+                results << "{\"mix\":\"" << mix.name << "\",\"engine\":\"" << options.engine << "\",\"threads\":" << workers
+                    << ",\"http\":\"" << (options.http2 == "prior-knowledge" ? "h2c" : "http/1.1") << "\""
+                    << ",\"files\":" << mix.files << ",\"completed\":" << result.completed << ",\"failed\":" << result.failed
+                    << ",\"bytes\":" << result.bytes << ",\"seconds\":" << result.seconds << ",\"files_per_s\":" << filesPerSecond
+                    << ",\"mb_per_s\":" << mb / result.seconds << ",\"cpu_s_per_gb\":" << cpuPerGb
+                    << ",\"peak_rss_mb\":" << rssMb << ",\"latency_ms\":" << server.config.latencyMs
+                    << ",\"error_percent\":" << options.benchErrorPercent << "}" << endl;
+            }
+        }
+    }
+
+    error_code ec;
+    filesystem::remove_all(root, ec);
+    StopBenchServer(server);
+    StopLogger();
+    logger.level = savedLevel;
+    logger.out = stdout;
+    logger.err = stderr;
+    if (nullSink) {
+        fclose(nullSink);
+    }
+    return 0;
+}
+
+int ParseIntOption(const string& name, const string& value, int minValue, int maxValue) {
+    int result;
+    try {
+        result = stoi(value);
+    }
+    catch (...) {
+        throw invalid_argument("  " + name + ": " + value);
+    }
+    if (result < minValue || result > maxValue) {
+        throw invalid_argument(name + "    " + to_string(minValue) + "  " + to_string(maxValue));
+    }
+    return result;
+}
+
+//       K, M  G.
+curl_off_t ParseSizeOption(const string& name, const string& value) {
+    size_t pos = 0;
+    long long result;
+    try {
+        result = stoll(value, &pos);
+    }
+    catch (...) {
+        throw invalid_argument("  " + name + ": " + value);
+    }
+    string suffix = value.substr(pos);
+    if (suffix == "K" || suffix == "k") result *= 1024LL;
+    else if (suffix == "M" || suffix == "m") result *= 1024LL * 1024;
+    else if (suffix == "G" || suffix == "g") result *= 1024LL * 1024 * 1024;
+    else if (!suffix.empty()) throw invalid_argument("  " + name + ": " + value);
+    if (result < 0) {
+        throw invalid_argument(name + "    ");
+    }
+    return result;
+}
+
+//     --name=value,    .
+void ParseOptions(int argc, char* argv[]) {
+    bool perHostGiven = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string name = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        if (name == "--engine") {
+            if (value != "threads" && value != "multi") {
+                throw invalid_argument(" : " + value);
+            }
+            options.engine = value;
         }
-        else {
-            new_path = directory / (stem + " (" + to_string(counter) + ")" + extension);
+        else if (name == "--max-inflight") {
+            options.maxInFlight = ParseIntOption(name, value, 1, 100000);
         }
-
-        if (!filesystem::exists(new_path)) {
-            return new_path.string();
+        else if (name == "--segment-threshold") {
+            options.segmentThreshold = ParseSizeOption(name, value);
+        }
+        else if (name == "--max-segments") {
+            options.maxSegments = ParseIntOption(name, value, 1, 64);
+        }
+        else if (name == "--per-host") {
+            options.perHostLimit = ParseIntOption(name, value, 0, 100000);
+            perHostGiven = true;
+        }
+        else if (name == "--http2") {
+            if (!value.empty() && value != "prior-knowledge") {
+                throw invalid_argument(" --http2  --http2=prior-knowledge: " + arg);
+            }
+            options.http2 = value.empty() ? "on" : value;
+        }
+        else if (name == "--max-streams") {
+            options.maxStreams = ParseIntOption(name, value, 1, 1000);
+        }
+        else if (name == "--host-limit") {
+            // --host-limit=example.com=2
+            size_t sep = value.rfind('=');
+            if (sep == string::npos || sep == 0) {
+                throw invalid_argument(" --host-limit=host=N: " + arg);
+            }
+            options.hostLimits[ExtractHost(value.substr(0, sep))] = ParseIntOption(name, value.substr(sep + 1), 0, 100000);
+        }
+        else if (name == "--retry") {
+            // --retry=0  --retry=net:3,timeout:2,429:5:2000,5xx:3 (:[: ])
+            if (value == "0") {
+                for (RetryPolicy& policy : options.retry) {
+                    policy.attempts = 0;
+                }
+                continue;
+            }
+            stringstream list(value);
+            string item;
+            while (getline(list, item, ',')) {
+                size_t sep = item.find(':');
+                auto found = find(begin(RetryClassNames), end(RetryClassNames), item.substr(0, sep));
+                if (sep == string::npos || found == end(RetryClassNames)) {
+                    throw invalid_argument(" --retry=:N[:],  net, timeout, 429, 5xx: " + item);
+                }
+                RetryPolicy& policy = options.retry[found - begin(RetryClassNames)];
+                size_t delaySep = item.find(':', sep + 1);
+                policy.attempts = ParseIntOption(name, item.substr(sep + 1, delaySep - sep - 1), 0, 100);
+                if (delaySep != string::npos) {
+                    policy.baseMs = ParseIntOption(name, item.substr(delaySep + 1), 1, 3600000);
+                }
+            }
+        }
+        else if (name == "--retry-max-ms") {
+            options.retryMaxMs = ParseIntOption(name, value, 1, 3600000);
+        }
+        else if (name == "--no-accept-encoding") {
+            options.acceptEncoding = false;
+        }
+        else if (name == "--store-zstd") {
+#ifdef HAVE_ZSTD
+            options.storeZstdLevel = value.empty() ? 3 : ParseIntOption(name, value, 1, 19);
+#else
+            throw invalid_argument("--store-zstd :    zstd");
+#endif
+        }
+        else if (name == "--adaptive") {
+            options.adaptive = true;
+        }
+        else if (name == "--max-bandwidth") {
+            options.maxBandwidth = ParseSizeOption(name, value);
+        }
+        else if (name == "--dedup") {
+            options.dedup = true;
+        }
+        else if (name == "--dedup-sha256") {
+            options.dedup = true;
+            options.dedupSha256 = true;
+        }
+        else if (name == "--queue-bound") {
+            options.queueBound = ParseIntOption(name, value, 1, 10000000);
+        }
+        else if (name == "--log-level") {
+            if (value == "debug") options.logLevel = LogLevel::Debug;
+            else if (value == "info") options.logLevel = LogLevel::Info;
+            else if (value == "warn") options.logLevel = LogLevel::Warn;
+            else if (value == "error") options.logLevel = LogLevel::Error;
+            else throw invalid_argument("  : " + value);
+        }
+        else if (name == "--metrics") {
+            options.metricsPath = value;
+        }
+        else if (name == "--metrics-interval-ms") {
+            options.metricsIntervalMs = ParseIntOption(name, value, 100, 3600000);
+        }
+        else if (name == "--log-json") {
+            options.logJson = value;
+        }
+        else if (name == "--bench") {
+            options.bench = true;
+        }
+        else if (name == "--bench-mix") {
+            options.benchMix = value;
+        }
+        else if (name == "--bench-threads") {
+            options.benchThreads.clear();
+            stringstream list(value);
+            string item;
+            while (getline(list, item, ',')) {
+                options.benchThreads.push_back(ParseIntOption(name, item, 1, 256));
+            }
+        }
+        else if (name == "--bench-latency-ms") {
+            options.benchLatencyMs = ParseIntOption(name, value, 0, 60000);
+        }
+        else if (name == "--bench-bandwidth") {
+            options.benchBandwidth = ParseSizeOption(name, value);
+        }
+        else if (name == "--bench-errors") {
+            options.benchErrorPercent = ParseIntOption(name, value, 0, 100);
+        }
+        else if (name == "--bench-out") {
+            options.benchOut = value;
+        }
+        else if (name == "--bench-log") {
+            options.benchLog = true;
+        }
+        else if (name == "--bench-dispatch") {
+            options.benchDispatch = true;
+        }
+        else if (name == "--daemon") {
+            if (value.empty()) {
+                throw invalid_argument("--daemon:   ");
+            }
+            options.daemonSocket = value;
+        }
+        else if (name == "--threads") {
+            options.daemonThreads = ParseIntOption(name, value, 1, 999);
+        }
+        else if (name == "--probe") {
+            options.probe = true;
+            if (!value.empty()) {
+                options.probeConcurrency = ParseIntOption(name, value, 1, 10000);
+            }
+        }
+        else if (name == "--resolve-ahead") {
+            options.dnsParallel = ParseIntOption(name, value, 0, 1000);
+        }
+        else if (name == "--dns-ttl") {
+            options.dnsTtl = ParseIntOption(name, value, 0, 86400);
+        }
+        else if (name == "--dns-negative-ttl") {
+            options.dnsNegativeTtl = ParseIntOption(name, value, 0, 86400);
+        }
+        else if (name == "--hosts") {
+            LoadHostsFile(value);
+        }
+        else if (name == "--fanout") {
+            options.fileIndex = true;
+            options.fanoutDepth = value.empty() ? 2 : ParseIntOption(name, value, 0, 4);
+        }
+        else if (name == "--lookup") {
+            if (value.empty()) {
+                throw invalid_argument("--lookup:   ");
+            }
+            options.lookupDirectory = value;
+        }
+        else if (name == "--pack") {
+            options.packSegmentSize = value.empty() ? 1024LL * 1024 * 1024 : ParseSizeOption(name, value);
+            if (options.packSegmentSize < PackObjectMax) {
+                throw invalid_argument("--pack:    1M");
+            }
+        }
+        else if (name == "--extract") {
+            if (value.empty()) {
+                throw invalid_argument("--extract:   ");
+            }
+            options.extractDirectory = value;
+        }
+        else if (name == "--extract-to") {
+            options.extractTarget = value.empty() ? "." : value;
+        }
+        else if (name == "--memory-budget") {
+            options.memoryBudget = ParseSizeOption(name, value);
+            if (options.memoryBudget < 1024 * 1024) {
+                throw invalid_argument("--memory-budget:   1M");
+            }
+        }
+        else if (name == "--writer") {
+            if (value != "uring" && value != "threads") {
+                throw invalid_argument("  : " + value);
+            }
+            options.writer = value;
+        }
+        else if (name == "--writer-threads") {
+            options.writerThreads = ParseIntOption(name, value, 1, 64);
+        }
+        else if (name == "--no-journal") {
+            options.journal = false;
+        }
+        else if (name == "--no-manifest") {
+            options.manifest = false;
+        }
+        else if (name == "--journal-sync-ms") {
+            options.journalSyncMs = ParseIntOption(name, value, 0, 60000);
+        }
+        else {
+            throw invalid_argument(" : " + arg);
         }
     }
-
-    auto now = chrono::system_clock::now();
-    auto timestamp = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count();
-
-    if (extension.empty()) {
-        return (directory / (stem + "_" + to_string(timestamp))).string();
+    if (options.packSegmentSize > 0 && options.fileIndex) {
+        throw invalid_argument("--pack  --fanout  :    ");
     }
-    else {
-        return (directory / (stem + "_" + to_string(timestamp) + extension)).string();
+    //     -  ,   .
+    if (!options.http2.empty() && !perHostGiven) {
+        options.perHostLimit = options.maxStreams;
     }
-
 }
 
-bool DowloadFunc(const string& url, string& directoryPath, int taskId) {
-        CURL* curl = curl_easy_init();
-       
-        if (!curl) {
-            cerr << "[Task" << GetCurrentTime() << taskId << "] " << endl;
-            return false;
+//       :
+//   bw <>|0   -    (K/M/G), 0 -  ;
+//   limit <N>|auto    -      .
+void ControlCommandLoop() {
+    string line;
+    while (getline(cin, line)) {
+        istringstream command(line);
+        string name, value;
+        command >> name >> value;
+        try {
+            if (name == "bw") {
+                bandwidthLimiter.rate = value == "0" ? 0 : ParseSizeOption(name, value);
+                Log(LogLevel::Info) << "[]   " << bandwidthLimiter.rate.load() << " /";
+            }
+            else if (name == "limit" && value == "auto") {
+                adaptiveControl.automatic = true;
+                Log(LogLevel::Info) << "[]   ";
+            }
+            else if (name == "limit") {
+                adaptiveControl.automatic = false;
+                SetTransferLimit(ParseIntOption(name, value, 1, adaptiveControl.maxLimit));
+                Log(LogLevel::Info) << "[]  " << transferGate.limit.load();
+            }
+            else if (!name.empty()) {
+                Log(LogLevel::Warn) << "[]  : " << line;
+            }
         }
-
-       
-        struct CurlGuard {
-            CURL* curl;
-            CurlGuard(CURL* c) : curl(c) {}
-            ~CurlGuard() { if (curl) curl_easy_cleanup(curl); }
-        } curl_guard(curl);
-
-        ResponseData response;
-        CURLcode res;
-
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.content);
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36");
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
-     
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-
-        cout << "[" << GetCurrentTime() << "] [ " << taskId << "]  : " << url << endl;
-        res = curl_easy_perform(curl);
-
-        if (res != CURLE_OK) {
-            cerr << "[Task" << taskId << "] :" << curl_easy_strerror(res) << endl;
- 
-            return false;
+        catch (const exception& e) {
+            Log(LogLevel::Warn) << "[] " << e.what();
         }
+    }
+}
 
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.responseCode);
-     
-
-        if (response.responseCode != 200) {
-            cerr << "[" << GetCurrentTime() << "] [Task" << taskId << "] HTTP " << response.responseCode << endl;
-            return false;
+//   ;  multi maxInFlight   .
+vector<thread> StartWorkers(int threadCount) {
+    vector<thread> workers;
+    if (options.engine == "multi") {
+        int perLoop = options.maxInFlight / threadCount;
+        for (int i = 0; i < threadCount; ++i) {
+            workers.emplace_back(MultiEngineThread, i, perLoop > 0 ? perLoop : 1);
         }
-        if (response.content.empty()) {
-            cerr << "[" << GetCurrentTime() << "[Task " << taskId << "] Empty response content" << endl;
-            return false;
+    }
+    else {
+        for (int i = 0; i < threadCount; ++i) {
+            workers.emplace_back(WorkerThread, i);
         }
-      
-
-        string filename;
+    }
+    return workers;
+}
 
-        if (!response.contentDisposition.empty()) {
-            filename = ExtractFileName(response.contentDisposition);
-        }
+//   (--daemon=<>): ,    DNS, 
+//      .   
+//   (AF_UNIX) ,   :
+//   submit <high|normal> <   URL> <>
+//       -> accepted <id>,    progress <id> <> <>,
+//            done <id> <> <> []
+//   status   -> job <id> <> <> <>  ,  end
+//   shutdown -> ok;    ,  , 
+//                
+//       .     
+// ;            .
+struct DaemonState {
+    atomic<bool> stopping{ false };
+    int nextJobId = 0;
+    mutex jobsMutex;
+    map<int, shared_ptr<const DownloadJob>> jobs;
+    int finishedJobs = 0;
 
-        if (filename.empty()) {
-            filename = ExtractFileNameFromUrl(url);
-        }
+    mutex clientsMutex;
+    vector<thread> clients;
+    vector<curl_socket_t> sockets;
+};
 
-        filename = ReplaceUnvalidName(filename);
+DaemonState daemonState;
 
-        filesystem::path dirpath(directoryPath);
-        error_code ec;
-        if (!filesystem::exists(dirpath, ec)) {
-            if (!filesystem::create_directories(dirpath, ec)) {
-                cerr << "[" << GetCurrentTime() << "[" << GetCurrentTime() << "[ " << taskId << "]    : " << ec.message() << endl;
-                return false;
-            }
-        }
+extern "C" void DaemonSignal(int) {
+    daemonState.stopping = true;
+}
 
-        string fullPath = UniqueFileName(dirpath, filename);
+bool SendLine(curl_socket_t socket, const string& line) {
+    string data = line + "\n";
+    return SendAll(socket, data.data(), data.size());
+}
 
-        ofstream file(fullPath, ios::binary);
-        if (!file.is_open()) {
-            cerr << "[" << GetCurrentTime() << "] [Task " << taskId << "]     " << fullPath << endl;
-            return false;
+void RunDaemonJob(curl_socket_t socket, const string& list, const string& directory, bool urgent) {
+    auto job = make_shared<DownloadJob>();
+    job->directoryPath = directory;
+    job->urgent = urgent;
+    job->progress = make_shared<JobProgress>();
+    {
+        lock_guard<mutex> lock(daemonState.jobsMutex);
+        if (daemonState.stopping) {
+            SendLine(socket, "error   ");
+            return;
         }
+        job->id = ++daemonState.nextJobId;
+        daemonState.jobs[job->id] = job;
+    }
+    JobProgress& progress = *job->progress;
+    string id = to_string(job->id);
+    bool connected = SendLine(socket, "accepted " + id);
+    Log(LogLevel::Info) << "[]  " << job->id << (urgent ? " (high): " : ": ") << list << " -> " << directory;
 
-        file.write(response.content.c_str(), response.content.size());
-        file.close();
-
-        if (!file) {
-            cerr << "[" << GetCurrentTime() << "[ " << taskId << "]  : " << fullPath << endl;
-            return false;
+    IngestStats stats;
+    progress.latch.Add(1);
+    tasksLatch.Add(1);
+    IngestUrls(list, job, stats);
+    progress.latch.CountDown();
+    while (!progress.latch.WaitFor(chrono::seconds(1))) {
+        if (connected) {
+            connected = SendLine(socket, "progress " + id + " " + to_string(progress.completed + progress.failed) + " " +
+                to_string(progress.total));
         }
-
-        cout << "[" << GetCurrentTime() << "[ " << taskId << "]  : " << fullPath
-            << " (" << response.content.size() << " bytes)" << endl;
-        return true;
     }
 
+    int completed = progress.completed, failed = progress.failed;
+    Log(LogLevel::Info) << "[]  " << job->id << " :  " << completed << ",  " << failed;
+    if (connected) {
+        SendLine(socket, "done " + id + " " + to_string(completed) + " " + to_string(failed) +
+            (stats.error.empty() ? string() : " " + stats.error));
+    }
+    lock_guard<mutex> lock(daemonState.jobsMutex);
+    daemonState.jobs.erase(job->id);
+    daemonState.finishedJobs++;
+}
 
-void WorkerThread() {
-    activeThreads++;
-
+void DaemonClientLoop(curl_socket_t socket) {
+    string buffer;
+    char chunk[4096];
     while (true) {
-        DownloadTask task;
-        {
-            unique_lock<mutex> lock(qMutex);
-            condition.wait(lock, [] {
-                return stopThreads || !taskQueue.empty();
-                });
-            if (stopThreads && taskQueue.empty()) {
+        size_t end = buffer.find('\n');
+        if (end == string::npos) {
+            int received = recv(socket, chunk, sizeof(chunk), 0);
+            if (received <= 0) {
                 break;
             }
-            if (!taskQueue.empty()){
-                task = taskQueue.front();
-                taskQueue.pop();
+            buffer.append(chunk, received);
+            continue;
+        }
+        string line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        vector<string> fields;
+        stringstream fieldStream(line);
+        string field;
+        while (getline(fieldStream, field, '\t')) {
+            fields.push_back(field);
+        }
+        if (fields.empty()) {
+            continue;
+        }
+
+        if (fields[0] == "submit") {
+            if (fields.size() != 4 || (fields[1] != "high" && fields[1] != "normal") || fields[3].empty()) {
+                SendLine(socket, "error  submit\\t<high|normal>\\t< URL>\\t<>");
+            }
+            else if (!filesystem::exists(fields[2])) {
+                SendLine(socket, "error   : " + fields[2]);
             }
             else {
-                continue;
+                RunDaemonJob(socket, fields[2], fields[3], fields[1] == "high");
+            }
+        }
+        else if (fields[0] == "status") {
+            vector<string> lines;
+            {
+                lock_guard<mutex> lock(daemonState.jobsMutex);
+                for (auto& entry : daemonState.jobs) {
+                    const JobProgress& progress = *entry.second->progress;
+                    lines.push_back("job " + to_string(entry.first) + " " + to_string(progress.completed + progress.failed) + " " +
+                        to_string(progress.total) + " " + entry.second->directoryPath);
+                }
+            }
+            lines.push_back("end");
+            for (const string& status : lines) {
+                SendLine(socket, status);
             }
         }
-        if (DowloadFunc(task.url, task.directoryPath, task.taskId)) {
-            completedTasks++;
+        else if (fields[0] == "shutdown") {
+            daemonState.stopping = true;
+            SendLine(socket, "ok");
         }
         else {
-            failedTasks++;
-        }
-        int processed = completedTasks + failedTasks;
-        if (processed % 10 == 0 || processed == totalTasks) {
-            cout << "[" << GetCurrentTime() << "] [] " << processed << "/" << totalTasks << "(" << (totalTasks > 0 ? (processed * 100 / totalTasks) : 0) << "%)" << endl;
+            SendLine(socket, "error  : " + fields[0]);
         }
     }
-    activeThreads--;
-   
+    {
+        lock_guard<mutex> lock(daemonState.clientsMutex);
+        daemonState.sockets.erase(remove(daemonState.sockets.begin(), daemonState.sockets.end(), socket), daemonState.sockets.end());
+    }
+    CloseSocket(socket);
 }
 
-void AddQueue(const string& url, const string& directoryPath, int taskId) {
-    lock_guard<mutex> lock(qMutex);
-    taskQueue.push({url, directoryPath, taskId});
-    condition.notify_one();
+curl_socket_t OpenDaemonSocket(const string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << ":     " << path << endl;
+        return CURL_SOCKET_BAD;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    curl_socket_t listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == CURL_SOCKET_BAD) {
+        cerr << ":    " << endl;
+        return CURL_SOCKET_BAD;
+    }
+    //      ,   - .
+    if (connect(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+        cerr << ":    " << path << endl;
+        CloseSocket(listener);
+        return CURL_SOCKET_BAD;
+    }
+    CloseSocket(listener);
+    error_code ec;
+    filesystem::remove(path, ec);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == CURL_SOCKET_BAD || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, 64) != 0) {
+        cerr << ":     " << path << endl;
+        if (listener != CURL_SOCKET_BAD) {
+            CloseSocket(listener);
+        }
+        return CURL_SOCKET_BAD;
+    }
+    return listener;
 }
 
-vector<string> ReadUrlsFromFile(const string& filename) {
-    vector<string> urls;
-    ifstream file(filename);
+int RunDaemon() {
+    const string& socketPath = options.daemonSocket;
+    int threadCount = options.daemonThreads;
 
-    if (!file.is_open()) {
-        throw runtime_error("  : " + filename);
+    if (options.manifest && !OpenManifest(socketPath + ".manifest")) {
+        StopLogger();
+        cerr << ":     " << socketPath << ".manifest" << endl;
+        return 1;
+    }
+    manifest.live = true;
+    if (options.fileIndex && !OpenFileIndex(socketPath + ".files", string())) {
+        StopLogger();
+        cerr << ":      " << socketPath << ".files" << endl;
+        return 1;
+    }
+    if (options.dedup && !OpenContentIndex(socketPath + ".contents")) {
+        cerr << ":      " << socketPath << ".contents" << endl;
+        return 1;
+    }
+    if (options.storeZstdLevel > 0 && !OpenStoredSizeIndex(socketPath + ".zstindex")) {
+        cerr << ":      " << socketPath << ".zstindex" << endl;
+        return 1;
+    }
+    curl_socket_t listener = OpenDaemonSocket(socketPath);
+    if (listener == CURL_SOCKET_BAD) {
+        return 1;
     }
 
-    string line;
-    while (getline(file, line)) {
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
+    //         .
+    hostScheduler = true;
+    InitDispatcher(threadCount);
+    StartRetryWheel();
+    StartDiskWriter();
+    if (!options.metricsPath.empty()) {
+        metricsWriter.writer = thread(MetricsWriterLoop, options.metricsPath, options.metricsIntervalMs);
+    }
+    bandwidthLimiter.rate = options.maxBandwidth;
+    StartAdaptiveControl(options.engine == "multi" ? options.maxInFlight : threadCount, options.adaptive);
+    vector<thread> workers = StartWorkers(threadCount);
+
+    signal(SIGINT, DaemonSignal);
+    signal(SIGTERM, DaemonSignal);
+    cout << "===  ===" << endl;
+    cout << ": " << socketPath << endl;
+    cout << ": " << threadCount << ",  " << options.engine << ",  " << DiskWriterName() << endl;
+
+    while (!daemonState.stopping) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listener, &readable);
+        timeval timeout{ 0, 100000 };
+        if (select(static_cast<int>(listener + 1), &readable, nullptr, nullptr, &timeout) <= 0) {
+            continue;
         }
+        curl_socket_t client = accept(listener, nullptr, nullptr);
+        if (client == CURL_SOCKET_BAD) {
+            continue;
+        }
+        lock_guard<mutex> lock(daemonState.clientsMutex);
+        daemonState.sockets.push_back(client);
+        daemonState.clients.emplace_back(DaemonClientLoop, client);
+    }
+    CloseSocket(listener);
+    error_code ec;
+    filesystem::remove(socketPath, ec);
 
-        if (!line.empty()) {
-            size_t start = line.find_first_not_of(" \t");
-            size_t end = line.find_last_not_of(" \t");
-            if (start != string::npos && end != string::npos) {
-                urls.push_back(line.substr(start, end - start + 1));
+    //     ,    .
+    while (true) {
+        {
+            lock_guard<mutex> lock(daemonState.jobsMutex);
+            if (daemonState.jobs.empty()) {
+                break;
             }
         }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    vector<thread> clients;
+    {
+        lock_guard<mutex> lock(daemonState.clientsMutex);
+        for (curl_socket_t socket : daemonState.sockets) {
+#ifdef _WIN32
+            shutdown(socket, SD_BOTH);
+#else
+            shutdown(socket, SHUT_RDWR);
+#endif
+        }
+        clients.swap(daemonState.clients);
+    }
+    for (auto& client : clients) {
+        client.join();
     }
 
-    if (urls.empty()) {
-        throw runtime_error("      URL");
+    StopRetryWheel();
+    stopThreads = true;
+    WakeAllWorkers();
+    for (auto& worker : workers) {
+        worker.join();
     }
+    ClosePackSegments();
+    StopDiskWriter();
+    ClosePackIndexes();
+    StopAdaptiveControl();
+    StopMetricsWriter();
+    StopLogger();
+    CloseContentIndex();
+    CloseStoredSizeIndex();
+    CloseManifest();
+    CloseFileIndex();
 
-    return urls;
+    cout << "\n===   ===" << endl;
+    cout << ": " << daemonState.finishedJobs << endl;
+    cout << ": " << completedTasks << endl;
+    cout << ": " << failedTasks << endl;
+    cout << "  : " << (connectedTransfers > 0 ? (reusedConnections * 100 / connectedTransfers) : 0)
+        << "% (" << reusedConnections << "/" << connectedTransfers << ")" << endl;
+    PrintMemorySummary();
+    PrintHostSummary();
+    PrintLatencySummary();
+    return 0;
 }
 
 
-
-int main() {
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
     SetConsoleCP(1251);
     SetConsoleOutputCP(1251);
+#endif
+
+    try {
+        ParseOptions(argc, argv);
+    }
+    catch (const exception& e) {
+        cerr << ": " << e.what() << endl;
+        return 1;
+    }
+
+    if (options.benchDispatch) {
+        RunDispatchBenchmark();
+        return 0;
+    }
+    if (options.benchLog) {
+        RunLogBenchmark();
+        return 0;
+    }
+    if (!options.lookupDirectory.empty()) {
+        return RunLookup();
+    }
+    if (!options.extractDirectory.empty()) {
+        return RunExtract();
+    }
+
+    if (!StartLogger(options.logLevel, options.logJson)) {
+        cerr << ":    " << options.logJson << endl;
+        return 1;
+    }
 
     if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
         cerr << "CURL   " << endl;
         return 1;
     }
     struct CurlGlobalCleanup {
-        ~CurlGlobalCleanup() { curl_global_cleanup(); }
+        ~CurlGlobalCleanup() {
+            if (curlShare) curl_share_cleanup(curlShare);
+            curl_global_cleanup();
+        }
     } curl_cleanup;
 
+    if (!InitCurlShare()) {
+        cerr << "CURL   share" << endl;
+        return 1;
+    }
+
+    if (options.bench) {
+        return RunBenchSuite();
+    }
+    if (!options.daemonSocket.empty()) {
+        return RunDaemon();
+    }
+
     try {
         string url, directoryPath, threadCountStr;
 
@@ -441,8 +7643,8 @@ int main() {
         int threadCount;
         try {
             threadCount = stoi(threadCountStr);
-            if (threadCount < 1 || threadCount > 16) {
-                cerr << "      1  16" << endl;
+            if (threadCount < 1 || threadCount > 999) {
+                cerr << "      1  999" << endl;
                 return 1;
             }
         }
@@ -452,77 +7654,200 @@ int main() {
         }
 
  
-        vector<string> urls;
-        try {
-            urls = ReadUrlsFromFile(url);
-            cout << " " << urls.size() << " URLs  " << endl;
-
+        if (options.journal && !OpenJournal(JournalPathFor(directoryPath))) {
+            cerr << ":     " << JournalPathFor(directoryPath) << endl;
+            return 1;
+        }
 
-            size_t preview_count = min(urls.size(), size_t(3));
-            cout << " " << preview_count << " URLs:" << endl;
-            for (size_t i = 0; i < preview_count; ++i) {
-                cout << "  " << (i + 1) << ". " << urls[i] << endl;
-            }
-            if (urls.size() > preview_count) {
-                cout << "  ...  " << (urls.size() - preview_count) << " more" << endl;
-            }
+        if (options.manifest && !OpenManifest(SiblingPath(directoryPath, ".manifest"))) {
+            StopLogger();
+            cerr << ":     " << SiblingPath(directoryPath, ".manifest") << endl;
+            CloseJournal(false);
+            return 1;
         }
-        catch (const exception& e) {
-            cerr << "  URL : " << e.what() << endl;
+
+        if (options.fileIndex && !OpenFileIndex(SiblingPath(directoryPath, ".files"), directoryPath)) {
+            StopLogger();
+            cerr << ":      " << SiblingPath(directoryPath, ".files") << endl;
+            CloseJournal(false);
             return 1;
         }
 
+        if (options.dedup && !OpenContentIndex(SiblingPath(directoryPath, ".contents"))) {
+            StopLogger();
+            cerr << ":      " << SiblingPath(directoryPath, ".contents") << endl;
+            CloseJournal(false);
+            return 1;
+        }
+        if (options.storeZstdLevel > 0 && !OpenStoredSizeIndex(SiblingPath(directoryPath, ".zstindex"))) {
+            StopLogger();
+            cerr << ":      " << SiblingPath(directoryPath, ".zstindex") << endl;
+            CloseJournal(false);
+            return 1;
+        }
 
-        totalTasks = static_cast<int>(urls.size());
-        for (size_t i = 0; i < urls.size(); ++i) {
-            AddQueue(urls[i], directoryPath, static_cast<int>(i + 1));
+        InitDispatcher(threadCount);
+        StartRetryWheel();
+        StartDiskWriter();
+        if (!options.metricsPath.empty()) {
+            metricsWriter.writer = thread(MetricsWriterLoop, options.metricsPath, options.metricsIntervalMs);
         }
 
         cout << "\n===   ===" << endl;
         cout << "URL : " << url << endl;
         cout << "  : " << directoryPath << endl;
         cout << ": " << threadCount << endl;
-        cout << " URLs: " << totalTasks << endl;
+        cout << ": " << options.engine << endl;
+        cout << "  : " << DiskWriterName() << ",  " << options.writerThreads << endl;
+        if (options.packSegmentSize > 0) {
+            cout << ":   " << PackObjectMax / 1048576 << " MB    " << options.packSegmentSize / 1048576
+                << " MB,  " << SiblingPath(directoryPath, ".packs") << endl;
+        }
+        if (options.fileIndex) {
+            cout << ": " << options.fanoutDepth << "  ,  "
+                << SiblingPath(directoryPath, ".files") << endl;
+        }
+        if (options.probe) {
+            cout << ": HEAD  " << options.probeConcurrency << " ,   " << endl;
+        }
+        if (options.dnsParallel > 0) {
+            cout << "DNS: ,  " << options.dnsParallel << "  ,   " << options.dnsTtl
+                << " ,  " << options.dnsNegativeTtl << " ";
+            if (!options.hostsPath.empty()) {
+                cout << ",   " << options.hostsPath;
+            }
+            cout << endl;
+        }
+        if (options.engine == "multi") {
+            cout << "  : " << options.maxInFlight << endl;
+        }
+        if (options.adaptive) {
+            cout << ": ,  " << (options.engine == "multi" ? options.maxInFlight : threadCount) << endl;
+        }
+        if (options.maxBandwidth > 0) {
+            cout << " : " << options.maxBandwidth << " /" << endl;
+        }
+        if (!options.http2.empty()) {
+            cout << "HTTP/2: " << (options.http2 == "prior-knowledge" ? "h2c" : "h2  ALPN");
+            if (options.engine == "multi") {
+                cout << ",  " << options.maxStreams << "   " << endl;
+            }
+            else {
+                cout << ",   (   multi)" << endl;
+            }
+        }
+        cout << ": bw <>|0, limit <N>|auto" << endl;
         cout << "========================\n" << endl;
 
-        vector<thread> workers;
-        for (int i = 0; i < threadCount; ++i) {
-            workers.emplace_back(WorkerThread);
-        }
+        bandwidthLimiter.rate = options.maxBandwidth;
+        StartAdaptiveControl(options.engine == "multi" ? options.maxInFlight : threadCount, options.adaptive);
+        thread(ControlCommandLoop).detach();
 
-        while (true) {
-            this_thread::sleep_for(chrono::milliseconds(500));
+        vector<thread> workers = StartWorkers(threadCount);
 
-            unique_lock<mutex> lock(qMutex);
-            if (taskQueue.empty() && activeThreads == 0) {
-                break;
-            }
+        //         .
+        auto job = make_shared<DownloadJob>();
+        job->directoryPath = directoryPath;
+        IngestStats ingest;
+        tasksLatch.Add(1);
+        thread producer(IngestUrls, url, job, ref(ingest));
 
- 
-            static auto last_report = chrono::steady_clock::now();
-            auto now = chrono::steady_clock::now();
-            if (chrono::duration_cast<chrono::seconds>(now - last_report).count() >= 5) {
-                int processed = completedTasks + failedTasks;
-                cout << "[Status] " << processed << "/" << totalTasks << " ("
-                    << (totalTasks > 0 ? (processed * 100 / totalTasks) : 0) << "%)" << endl;
-                last_report = now;
+        //    ,   5   .
+        while (!tasksLatch.WaitFor(chrono::seconds(5))) {
+            if (activeThreads == 0) {
+                break;
             }
+            int processed = completedTasks + failedTasks;
+            int total = totalTasks;
+            Log(LogLevel::Info) << "[Status] " << processed << "/" << total << " ("
+                << (total > 0 ? (processed * 100 / total) : 0) << "%)" << ByteProgress();
         }
 
+        producer.join();
+        StopRetryWheel();
         stopThreads = true;
-        condition.notify_all();
+        WakeAllWorkers();
 
         for (auto& worker : workers) {
             if (worker.joinable()) {
                 worker.join();
             }
         }
+        ClosePackSegments();
+        StopDiskWriter();
+        ClosePackIndexes();
+
+        StopAdaptiveControl();
+        StopMetricsWriter();
+        StopLogger();
+
+        if (!ingest.error.empty()) {
+            cerr << "  URL : " << ingest.error << endl;
+            CloseJournal(false);
+            return 1;
+        }
+
+        CloseJournal(completedTasks + failedTasks >= totalTasks);
+        CloseContentIndex();
+        CloseStoredSizeIndex();
+        CloseManifest();
+        CloseFileIndex();
 
         cout << "\n===   ===" << endl;
+        cout << "  URL: " << ingest.urls << ", : " << ingest.duplicates << endl;
+        if (ingest.skipped > 0 || ingest.resumed > 0) {
+            cout << ":   " << ingest.skipped << ",  " << ingest.resumed << endl;
+        }
         cout << " URLs: " << totalTasks << endl;
         cout << ": " << completedTasks << endl;
+        if (notModifiedTasks > 0) {
+            cout << "  (304): " << notModifiedTasks << endl;
+        }
         cout << ": " << failedTasks << endl;
+        if (retriedTasks > 0) {
+            cout << "  : " << retriedTasks << endl;
+        }
+        if (dnsResolvedNames + dnsFailedNames > 0) {
+            cout << "DNS:   " << dnsResolvedNames << ",   " << dnsFailedNames
+                << ",    " << dnsFastFailures << endl;
+        }
         cout << " : " << (totalTasks > 0 ? (completedTasks * 100 / totalTasks) : 0) << "%" << endl;
+        cout << "  : " << (connectedTransfers > 0 ? (reusedConnections * 100 / connectedTransfers) : 0)
+            << "% (" << reusedConnections << "/" << connectedTransfers << ")" << endl;
+        if (http2Transfers > 0) {
+            cout << " HTTP/2: " << http2Transfers << " " << endl;
+        }
+        if (transferWireBytes > 0) {
+            long long wire = transferWireBytes, logical = transferLogicalBytes;
+            cout << ": " << fixed << setprecision(1) << wire / 1048576.0 << " MB  , "
+                << logical / 1048576.0 << " MB ";
+            if (logical > wire) {
+                cout << " (  " << (logical - wire) * 100 / logical << "%)";
+            }
+            cout << endl;
+        }
+        if (compressedFiles > 0) {
+            cout << "  : " << compressedFiles << " , " << fixed << setprecision(1)
+                << compressedLogicalBytes / 1048576.0 << " MB -> " << compressedStoredBytes / 1048576.0 << " MB" << endl;
+        }
+        if (packedFiles > 0) {
+            cout << ": " << packedFiles << " , " << fixed << setprecision(1) << packedBytes / 1048576.0
+                << " MB  " << packSegments << " " << endl;
+        }
+        if (diskWriteBatches > 0) {
+            cout << "  : " << diskWriteOps << "   " << diskWriteBatches << "  (" << DiskWriterName() << ")" << endl;
+        }
+        PrintMemorySummary();
+        if (options.dedup) {
+            cout << " : " << dedupLinkedFiles << "  ,  "
+                << fixed << setprecision(1) << dedupSavedBytes / 1048576.0 << " MB" << endl;
+        }
+        if (options.adaptive) {
+            cout << ":  " << transferGate.limit << " ( " << adaptiveControl.lowestLimit
+                << "  " << adaptiveControl.highestLimit << ")" << endl;
+        }
+        PrintHostSummary();
+        PrintLatencySummary();
 
     }
     catch (const exception& e) {